@@ -4,6 +4,9 @@
 #include "common.h"
 #include "value.h"
 
+/* Number of receiver layouts a property access or invoke site remembers. */
+#define CACHE_ENTRIES   4
+
 /**
  * Operational codes or bytecode instructions used by the virtual machine for
  * interpretation. Each of the them is 8-bit long and require different amounts
@@ -41,8 +44,6 @@ typedef enum
     OP_GET_GLOBAL,
     OP_GET_UPVALUE, 
     OP_SET_UPVALUE,
-    OP_GET_PROPERTY, 
-    OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_CALL,
     OP_CLOSURE,
@@ -52,26 +53,121 @@ typedef enum
     OP_JUMP,
     OP_JUMP_FALSE,
     OP_LOOP,
+    /* Property name and inline cache index. */
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    /* Method name, argument count and inline cache index. */
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    /*
+     * Wide forms of the opcodes above, only emitted when the operand doesn't
+     * fit in a byte. Slots and names take two bytes and other constant
+     * indexes three.
+     */
+    OP_CONSTANT_LONG,
+    OP_CLOSURE_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_UPVALUE_LONG,
+    OP_SET_UPVALUE_LONG,
+    OP_GET_SUPER_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    /*
+     * Superinstructions, emitted by the compiler in place of common opcode
+     * sequences. Their operands are the ones from the fused opcodes, in the
+     * same order.
+     */
+    OP_ADD_LOCALS,
+    OP_ADD_LOCAL_CONST,
+    OP_SUBTRACT_LOCAL_CONST,
+    OP_LESS_LOCAL_CONST_JUMP,
+    OP_GREATER_LOCAL_CONST_JUMP,
+    OP_GET_LOCAL_PROPERTY,
+    OP_SET_LOCAL_POP,
+    OP_SET_PROPERTY_POP,
 } OpCode;
 
+/**
+ * Result of a property lookup, remembered by the instruction that made it.
+ * 
+ * `shape` is the receiver's shape the entry applies to, or `NULL` for
+ *         `OP_SUPER_INVOKE`, whose lookup starts at the superclass.
+ * `class` is the receiver's class if the property is a method, or `NULL` if
+ *         it is a field.
+ * `target` is the method's closure, or the shape the receiver moves to when
+ *          the instruction adds a field.
+ * `index` is the position of the field in the receiver's field array, or the
+ *         class' `version` when the method was cached.
+ */
+typedef struct
+{
+    Obj*    shape;
+    Obj*    class;
+    Obj*    target;
+    int     index;
+} CacheEntry;
+
+/**
+ * Inline cache of a property access or invoke site, monomorphic while it only holds one
+ * entry and polymorphic up to `CACHE_ENTRIES` of them.
+ * 
+ * `count` is the number of entries filled.
+ * `entries` is the array of cached lookups.
+ */
+typedef struct
+{
+    int         count;
+    CacheEntry  entries[CACHE_ENTRIES];
+} InlineCache;
+
+/**
+ * Start of a run of bytecode emitted from the same line, which lasts until
+ * the next run's `offset`.
+ * 
+ * `offset` is the position of the run's first byte in the chunk.
+ * `line` is the line every byte in the run was emitted from.
+ */
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
 /**
  * Structure representing a dynamic array of bytecode instructions.
  * 
  * `count` is the current number of instructions in the vector.
  * `capacity` is the size of the vector.
  * `code` is an array of instructions.
- * `lines` is an array of line positions for each instruction
+ * `line_count` is the number of line runs in the chunk.
+ * `line_capacity` is the size of the line run vector.
+ * `lines` is a run-length encoded table of the lines the code was emitted
+ *         from, in ascending order of offset.
  * `constants` is the contant values in the chunk's scope.
+ * `cache_count` is the number of inline caches in the chunk.
+ * `cache_capacity` is the size of the inline cache vector.
+ * `caches` is the inline caches of the chunk's property instructions.
  */
 typedef struct
 {
-    int         count;
-    int         capacity;
-    uint8_t*    code;
-    int*        lines;
-    ValueArray  constants;
+    int             count;
+    int             capacity;
+    uint8_t*        code;
+    int             line_count;
+    int             line_capacity;
+    LineStart*      lines;
+    ValueArray      constants;
+    int             cache_count;
+    int             cache_capacity;
+    InlineCache*    caches;
 } Chunk;
 
 /** Allocates and initializes a chunk specified by `chunk`. */
@@ -86,6 +182,20 @@ void free_chunk(Chunk* chunk);
  */
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 
+/**
+ * Drops the bytecode of a chunk specified by `chunk` past a length specified
+ * by `count`, along with the line runs starting there.
+ */
+void truncate_chunk(Chunk* chunk, int count);
+
+/**
+ * Finds the line a byte at a position specified by `offset` was emitted from
+ * in a chunk specified by `chunk`.
+ * 
+ * Returns the line of the byte.
+ */
+int get_line(Chunk* chunk, int offset);
+
 /**
  * Inserts a value specified by `value` to the constant table of a chunk
  * specified by `chunk`.
@@ -94,4 +204,11 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line);
  */
 int add_constant(Chunk* chunk, Value value);
 
+/**
+ * Inserts an empty inline cache to a chunk specified by `chunk`.
+ * 
+ * Returns the index of the new cache.
+ */
+int add_cache(Chunk* chunk);
+
 #endif
\ No newline at end of file
@@ -3,9 +3,30 @@
 
 #include "vm.h"
 
+/* Bytes allocated between two collections of the nursery. */
+#define GC_NURSERY_SIZE     0x100000
+/* Growth of the heap between two full collections. */
+#define GC_HEAP_GROW_FACTOR 2
+/* Bytes allocated between two slices of an incremental collection. */
+#define GC_SLICE_INTERVAL   0x10000
+/* Bitmap words of the old generation swept by every allocation of an object. */
+#define GC_SWEEP_SLICE      2
+/* Most threads tracing a full collection. */
+#define GC_MAX_THREADS      64
+/* Heap compacted once this fraction of its pages could be released, as a divisor. */
+#define GC_COMPACT_RATIO    4
+/* Fewest pages a compaction must release to be worth it. */
+#define GC_COMPACT_MIN      4
+
 /** Marks a heap-stored value specified by `obj` for collection. */
 void mark_object(Obj* obj);
 
+/**
+ * Marks an object specified by `obj` and pushes it onto the gray stack
+ * without looking into it, which allows objects whose fields aren't set yet.
+ */
+void gray_object(Obj* obj);
+
 /** Marks a stack-stored value specified by `value` for collection. */
 void mark_value(Value value);
 
@@ -17,7 +38,97 @@ void table_remove_white(Table* table);
 /** Marks all the positions from a table specified by `table`. */
 void mark_table(Table* table);
 
-/** Triggers garbage collection for all ends of the interpreter. */
+/**
+ * Triggers garbage collection for all ends of the interpreter, which only
+ * covers the nursery unless the old generation outgrew its threshold.
+ * 
+ * When `vm.slice_budget` is positive, full collections are incremental: the
+ * first call marks the roots, the next ones trace a slice of the gray stack
+ * each, and the last one finishes marking. Either way, the old generation is
+ * then swept by `sweep_slice`, or by a sweeper thread when
+ * `vm.background_sweep` is set, while minor collections go on.
+ */
 void collect_garbage();
 
+/**
+ * Collects garbage from the whole heap without interruption, finishing an
+ * incremental collection if one is going on, and sweeps it right away so that
+ * the memory of every dead object is given back.
+ */
+void collect_all_garbage();
+
+/**
+ * Moves the objects of the sparsest pages of the heap into the others and
+ * releases them, updating every reference to the objects moved. A full
+ * collection still going on is finished first.
+ *
+ * Only called at safe points of the interpreter, where no object address is
+ * held anywhere but in the heap, the stack, call frames and the vm's roots.
+ */
+void compact_heap();
+
+/**
+ * Frees a slice of the dead objects found by the last full collection, which
+ * are swept as new objects get allocated instead of all at once.
+ */
+void sweep_slice();
+
+/**
+ * Counts the objects in the heap by type into `counts`, indexed by `ObjType`.
+ * Dead objects not freed yet are counted too.
+ */
+void count_objects(int counts[]);
+
+/** Prints the statistics of the garbage collector to stderr. */
+void print_gc_stats();
+
+/**
+ * Waits for the sweeper thread, if one is running, to free the dead objects
+ * of the last full collection.
+ */
+void wait_for_sweeper();
+
+/** Adds a new object specified by `obj` to the nursery. */
+void add_young(Obj* obj);
+
+/**
+ * Adds an old object specified by `obj` to the remembered set, whose objects
+ * are traced by minor collections as if they were roots.
+ */
+void remember_object(Obj* obj);
+
+/**
+ * Write barrier for an object specified by `obj`, called after storing a
+ * reference in it. An old object may then point to young ones, which minor
+ * collections don't find unless the object is remembered. Likewise, a black
+ * object written to while marking incrementally may point to white ones, so
+ * it is remembered to be traced again when marking finishes.
+ */
+static inline void write_barrier(Obj* obj)
+{
+    if (obj->is_remembered) {
+        return;
+    }
+    if (obj->is_old || (vm.marking && is_marked(obj) && !obj->is_gray)) {
+        remember_object(obj);
+    }
+}
+
+/**
+ * Write barrier for an object specified by `obj`, called after storing a
+ * value specified by `value` in it, which skips values that aren't young or
+ * white objects.
+ */
+static inline void write_barrier_value(Obj* obj, Value value)
+{
+    if (!IS_OBJ(value)) {
+        return;
+    }
+    Obj* target = AS_OBJ(value);
+
+    if (!target->is_old || (vm.marking && !is_marked(target))) {
+        write_barrier(obj);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "common.h"
+#include "value.h"
+
+/* Bytes of a page, which is also its alignment. */
+#define HEAP_PAGE_SIZE      0x10000
+/* Objects are sized in multiples of a granule, each one taking a bitmap bit. */
+#define HEAP_GRANULE        16
+/*
+ * Size classes grow a granule at a time up to this size, then by a quarter of
+ * each power of two, which bounds the space lost to rounding to a fifth.
+ */
+#define HEAP_SMALL_BLOCK    256
+/* Objects larger than this, a quarter of a page, get a page of their own. */
+#define HEAP_MAX_BLOCK      (HEAP_PAGE_SIZE / 4)
+/* Classes up to `HEAP_SMALL_BLOCK`, plus four for each of the doublings past it. */
+#define HEAP_CLASS_COUNT    (HEAP_SMALL_BLOCK / HEAP_GRANULE + 4 * 6)
+#define HEAP_BITMAP_WORDS   (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+/* Blocks start past the page header, on a granule boundary. */
+#define PAGE_HEADER_SIZE \
+    ((sizeof(Page) + HEAP_GRANULE - 1) / HEAP_GRANULE * HEAP_GRANULE)
+
+/* Page holding an object, found by masking its address. */
+#define PAGE_OF(obj) \
+    ((Page*)((uintptr_t)(obj) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+/* Index of the bitmap bit standing for an object in its page. */
+#define GRANULE_OF(obj) \
+    (((uintptr_t)(obj) & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE)
+
+/* Bitmap word and bit standing for an object in its page. */
+#define WORD_OF(obj)        (GRANULE_OF(obj) / 64)
+#define BIT_OF(obj)         ((uint64_t)1 << (GRANULE_OF(obj) % 64))
+
+/* Object standing for a bit specified by `bit` in a page's bitmap word. */
+#define PAGE_OBJECT(page, word, bit) \
+    ((Obj*)((char*)(page) + ((word) * 64 + (bit)) * HEAP_GRANULE))
+
+/* Object of a page holding a single large one. */
+#define LARGE_OBJECT(page)  ((Obj*)((char*)(page) + PAGE_HEADER_SIZE))
+
+#define IS_LARGE_PAGE(page) ((page)->block_size > HEAP_MAX_BLOCK)
+
+/**
+ * Aligned chunk of memory holding objects of a single size class, or a single
+ * large object.
+ *
+ * `prev` and `next` link the heap's pages together.
+ * `block_size` is the size of the page's objects, or the whole size of the
+ *              page if it holds a large one.
+ * `unswept` tells whether the page holds objects not swept yet since the last
+ *           full collection.
+ * `evacuated` tells whether a compaction moved the page's objects elsewhere,
+ *             leaving it to be released once references to them are updated.
+ * `allocated` is a bitmap telling which granules start an object.
+ * `marked` is a bitmap telling which objects the garbage collector found
+ *          reachable, kept apart from them so that marking doesn't write to
+ *          objects already marked and clearing the marks doesn't touch them.
+ */
+typedef struct Page
+{
+    struct Page*    prev;
+    struct Page*    next;
+    size_t          block_size;
+    bool            unswept;
+    bool            evacuated;
+    uint64_t        allocated[HEAP_BITMAP_WORDS];
+    uint64_t        marked[HEAP_BITMAP_WORDS];
+} Page;
+
+/** Free block of a size class, linked to the next one through its memory. */
+typedef struct FreeBlock
+{
+    struct FreeBlock* next;
+} FreeBlock;
+
+/**
+ * Page-based heap, where objects are found by scanning the bitmaps of its
+ * pages instead of being linked to each other.
+ *
+ * `pages` is a linked-list of the heap's pages, newest first.
+ * `free_blocks` are the lists of free blocks of every size class.
+ */
+typedef struct
+{
+    Page*       pages;
+    FreeBlock*  free_blocks[HEAP_CLASS_COUNT];
+} Heap;
+
+/** Initializes a heap specified by `heap`, not performing any allocation. */
+void init_heap(Heap* heap);
+
+/**
+ * Releases the pages of a heap specified by `heap`, whose objects must have
+ * been freed already.
+ */
+void free_heap(Heap* heap);
+
+/**
+ * Returns the number of bytes a heap takes to hold an object of `size` bytes,
+ * which is the size of its class or of its own page.
+ */
+size_t heap_block_size(size_t size);
+
+/**
+ * Takes a block of `size` bytes from a heap specified by `heap`, adding a
+ * page to it if needed.
+ *
+ * Returns a pointer to the block.
+ */
+Obj* heap_alloc(Heap* heap, size_t size);
+
+/**
+ * Gives a block specified by `obj` back to a heap specified by `heap`, which
+ * releases it right away if it has a page of its own.
+ */
+void heap_free(Heap* heap, Obj* obj);
+
+/**
+ * Counts the pages of a heap specified by `heap` holding small objects into
+ * `page_count`.
+ *
+ * Returns how many of them moving their objects into the free blocks of the
+ * others would release.
+ */
+int heap_spare_pages(Heap* heap, int* page_count);
+
+/**
+ * Moves the objects of the sparsest pages of every size class in a heap
+ * specified by `heap` into the free blocks of the others, which must be
+ * unmarked. Each moved object is marked and left holding its new address,
+ * as found by `forwarded`.
+ *
+ * Returns the number of pages evacuated.
+ */
+int heap_evacuate(Heap* heap);
+
+/** Releases the pages of a heap specified by `heap` evacuated by `heap_evacuate`. */
+void heap_release_evacuated(Heap* heap);
+
+/** Tells whether an object specified by `obj` is marked as reachable. */
+static inline bool is_marked(Obj* obj)
+{
+    return (PAGE_OF(obj)->marked[WORD_OF(obj)] & BIT_OF(obj)) != 0;
+}
+
+/** Marks an object specified by `obj` as reachable. */
+static inline void set_marked(Obj* obj)
+{
+    PAGE_OF(obj)->marked[WORD_OF(obj)] |= BIT_OF(obj);
+}
+
+/**
+ * Marks an object specified by `obj` as reachable with an atomic operation, so
+ * that threads marking the same object at once agree on which one did.
+ *
+ * Returns whether the object wasn't marked before.
+ */
+static inline bool try_mark(Obj* obj)
+{
+    uint64_t* word = &PAGE_OF(obj)->marked[WORD_OF(obj)];
+    uint64_t bit = BIT_OF(obj);
+
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+        return false;
+    }
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+/** Clears the mark of an object specified by `obj`. */
+static inline void clear_marked(Obj* obj)
+{
+    PAGE_OF(obj)->marked[WORD_OF(obj)] &= ~BIT_OF(obj);
+}
+
+/**
+ * Returns the address an object specified by `obj` was moved to by
+ * `heap_evacuate`, or the object itself if it stayed in place.
+ */
+static inline Obj* forwarded(Obj* obj)
+{
+    return is_marked(obj) ? *(Obj**)obj : obj;
+}
+
+/** Returns the index of the lowest bit set in a bitmap word specified by `word`. */
+static inline int lowest_bit(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+
+    while (!(word & 1)) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+/** Returns the number of bits set in a bitmap word specified by `word`. */
+static inline int count_bits(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    int count = 0;
+
+    for (; word; word &= word - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+#endif
\ No newline at end of file
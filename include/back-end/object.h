@@ -14,6 +14,7 @@
 #define IS_FUNC(val)            is_obj_type(val, OBJ_FUNC)
 #define IS_INSTANCE(val)        is_obj_type(val, OBJ_INSTANCE)
 #define IS_NATIVE(val)          is_obj_type(val, OBJ_NATIVE)
+#define IS_SHAPE(val)           is_obj_type(val, OBJ_SHAPE)
 #define IS_STR(val)             is_obj_type(val, OBJ_STR)
 
 #define AS_BOUND_METHOD(val)    ((ObjBoundMethod*)AS_OBJ(val))
@@ -22,6 +23,7 @@
 #define AS_FUNC(val)            ((ObjFun*)AS_OBJ(val))
 #define AS_INSTANCE(val)        ((ObjInst*)AS_OBJ(val))
 #define AS_NATIVE(val)          (((ObjNative*)AS_OBJ(val))->function)
+#define AS_SHAPE(val)           ((ObjShape*)AS_OBJ(val))
 #define AS_STR(val)             ((ObjStr*)AS_OBJ(val))
 #define AS_CSTR(val)            (((ObjStr*)AS_OBJ(val))->chars)
 
@@ -34,10 +36,13 @@ typedef enum
     OBJ_FUNC,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STR,
     OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT          (OBJ_UPVALUE + 1)
+
 /** 
  * Structure representing common components of dynamically allocated values.
  * 
@@ -46,16 +51,18 @@ typedef enum
  * through struct inheritance. 
  * 
  * `type` is the type of the object.
- * `is_marked` is a garbage collection flag determning whether the object is
- *             reachable in memory or not.
- * `next` is a way to construct a linked-list of objects, used by the vm to
- *        keep track of allocations.
+ * `is_gray` tells whether the object is marked but its references weren't
+ *           traced yet.
+ * `is_old` tells whether the object survived a collection, moving it from the
+ *          nursery to the old generation.
+ * `is_remembered` tells whether the object is in the vm's remembered set.
  */
 struct Obj
 {
     ObjType     type;
-    bool        is_marked;
-    struct Obj* next;
+    bool        is_gray;
+    bool        is_old;
+    bool        is_remembered;
 };
 
 /**
@@ -63,6 +70,8 @@ struct Obj
  * 
  * `arity` is the number of parameters the function expects.
  * `upvalue_count` is the number of upvalues accessed by the function.
+ * `max_stack` is the most stack slots a call to the function uses, counting
+ *             the callee's slot.
  * `chunk` is the function's bytecode.
  * `name` is the name of the function.
  */
@@ -71,6 +80,7 @@ typedef struct
     Obj     obj;
     int     arity;
     int     upvalue_count;
+    int     max_stack;
     Chunk   chunk;
     ObjStr* name;
 } ObjFun;
@@ -92,15 +102,24 @@ typedef struct
 /**
  * Structure representing a string object in the language.
  * 
+ * Strings are interned, so that equal ones share an object, except for the
+ * longer results of concatenations, which mostly end up as operands of
+ * another one. Those are compared by content instead and never used as
+ * table keys.
+ *
  * `length` is the size of the string.
- * `hash` is the hash code calculated for the string upon definition.
- * `chars` is the string content, behaves as a flexible array member.
+ * `hash` is the hash code calculated for the string upon definition, only
+ *        meaningful for interned strings.
+ * `is_interned` tells whether the string is in the vm's string table.
+ * `chars` is the null-terminated string content, behaves as a flexible array
+ *         member.
  */
 struct ObjStr
 {
     Obj         obj;
     int         length;
     uint32_t    hash;
+    bool        is_interned;
     char        chars[];
 };
 
@@ -145,25 +164,54 @@ typedef struct
  * `name` is the name of the class.
  * `methods` is a method hash table whose keys are the methods names and the
  *           values are closure objects. 
+ * `version` is bumped whenever `methods` changes, telling cached method
+ *           lookups apart from stale ones.
  */
 typedef struct
 {
     Obj     obj;
     ObjStr* name;
     Table   methods;
+    int     version;
 } ObjClass;
 
+/**
+ * Shape object, also known as a hidden class.
+ * 
+ * Instances that had the same fields added in the same order share a shape,
+ * which maps each field name to a position in their field arrays. Adding a
+ * field moves an instance to another shape, and the path taken is recorded so
+ * later instances reuse it. Shapes are never freed while the root one is alive.
+ * 
+ * `count` is the number of fields of an instance with this shape.
+ * `slots` is a hash table whose keys are field names and the values are
+ *         their indexes in the field array.
+ * `transitions` is a hash table whose keys are field names and the values are
+ *               the shapes reached by adding them.
+ */
+typedef struct
+{
+    Obj     obj;
+    int     count;
+    Table   slots;
+    Table   transitions;
+} ObjShape;
+
 /**
  * Instance object.
  * 
  * `class` is a pointer to the instance's class.
- * `fields` is a hash table of the instance's state.
+ * `shape` is the instance's shape, describing the layout of `fields`.
+ * `capacity` is the length of `fields`.
+ * `fields` is a dense array of the instance's state.
  */
 typedef struct 
 {
     Obj         obj;
     ObjClass*   class;
-    Table       fields;
+    ObjShape*   shape;
+    int         capacity;
+    Value*      fields;
 } ObjInst;
 
 /**
@@ -220,6 +268,28 @@ ObjFun* new_func();
  */
 ObjInst* new_instance(ObjClass* class);
 
+/**
+ * Allocates and initializes a shape without fields.
+ * 
+ * Returns a pointer to the new shape.
+ */
+ObjShape* new_shape();
+
+/**
+ * Looks for a field specified by `name` in a shape specified by `shape`.
+ * 
+ * Returns the index of the field, or -1 if the shape doesn't have it.
+ */
+int shape_find(ObjShape* shape, ObjStr* name);
+
+/**
+ * Sets a field specified by `name` of an instance specified by `instance` to
+ * `value`, adding the field and moving the instance to a new shape if needed.
+ * 
+ * Returns the index of the field.
+ */
+int set_field(ObjInst* instance, ObjStr* name, Value value);
+
 /**
  * Allocates and initializes a native function with a signature specified by
  * `fun`.
@@ -229,12 +299,12 @@ ObjInst* new_instance(ObjClass* class);
 ObjNative* new_native(NativeFun fun);
 
 /**
- * Takes ownership of a character stream specified by `data` with size `len`,
- * converting it to a string object.
+ * Joins the contents of `a` followed by those of `b` into a string, which is
+ * only interned if short. Either operand is reused if the other is empty.
  * 
- * Returns a pointer to the new string object.
+ * Returns a pointer to the string object.
  */
-ObjStr* take_str(char* data, int len);
+ObjStr* join_str(ObjStr* a, ObjStr* b);
 
 /**
  * Converts a static allocated string specified by `chars` woth size `len`
@@ -244,6 +314,12 @@ ObjStr* take_str(char* data, int len);
 */
 ObjStr* copy_str(const char* chars, int len);
 
+/**
+ * Returns the name of the objects of a type specified by `type`, as used by
+ * the garbage collector's statistics.
+ */
+const char* obj_type_name(ObjType type);
+
 /** Pretty prints an object value specified by `value`. */
 void print_obj(Value value);
 
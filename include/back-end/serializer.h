@@ -0,0 +1,38 @@
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#include "common.h"
+#include "object.h"
+
+/* Extension of the bytecode files written by `--compile`. */
+#define BYTECODE_EXT        ".loxc"
+
+/*
+ * Version of the bytecode file format, bumped whenever it or the instruction
+ * set changes so that files written by older builds are rejected.
+ */
+#define BYTECODE_VERSION    3
+
+/**
+ * Writes a compiled script specified by `script`, along with the names of the
+ * global slots its code refers to, to a bytecode file at `path`. The hash of
+ * the script's source, specified by `source`, is stored in the file's header.
+ *
+ * Returns whether the file could be written or not.
+ */
+bool save_bytecode(const char* path, const char* source, ObjFun* script);
+
+/**
+ * Maps a bytecode file at `path` into memory and rebuilds the script in it,
+ * reserving its global slots in the vm.
+ *
+ * When `source` is provided, a missing file or one compiled from a different
+ * source or by a different build is silently rejected, which lets a stale
+ * cache fall back to compilation. Otherwise, those are reported as errors.
+ * Corrupted files are always reported.
+ *
+ * Returns a pointer to the script, or `NULL` if the file was rejected.
+ */
+ObjFun* load_bytecode(const char* path, const char* source);
+
+#endif
\ No newline at end of file
@@ -25,11 +25,14 @@ typedef struct ObjStr ObjStr;
 #define BOOL_VAL(val)   ((val) ? TRUE_VAL : FALSE_VAL)
 #define NUM_VAL(val)    num_from_val(val)
 #define OBJ_VAL(val)    (Value)(SIGN_BIT | QNAN | (uintptr_t)(val))
+/* Null object reference, marks a global slot that wasn't defined yet. */
+#define UNDEFINED_VAL   ((Value)(uint64_t)(SIGN_BIT | QNAN))
 
 #define IS_BOOL(val)    (((val) | 1) == TRUE_VAL)
 #define IS_NIL(val)     ((val) == NIL_VAL)
 #define IS_NUM(val)     (((val) & QNAN) != QNAN)
 #define IS_OBJ(val)     (((val) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(val) ((val) == UNDEFINED_VAL)
 
 #define AS_BOOL(val)    ((val) == TRUE_VAL)
 #define AS_NUM(val)     val_from_num(val)
@@ -41,11 +44,14 @@ typedef struct ObjStr ObjStr;
 #define NIL_VAL         ((Value){VAL_NIL, {.number = 0}})
 #define NUM_VAL(val)    ((Value){VAL_NUM, {.number = val}})
 #define OBJ_VAL(val)    ((Value){VAL_OBJ, {.obj = (Obj*)val}})
+/* Null object reference, marks a global slot that wasn't defined yet. */
+#define UNDEFINED_VAL   ((Value){VAL_OBJ, {.obj = NULL}})
 
 #define IS_BOOL(val)    ((val).type == VAL_BOOL)
 #define IS_NIL(val)     ((val).type == VAL_NIL)
 #define IS_NUM(val)     ((val).type == VAL_NUM)
 #define IS_OBJ(val)     ((val).type == VAL_OBJ)
+#define IS_UNDEFINED(val) (IS_OBJ(val) && !AS_OBJ(val))
 
 #define AS_BOOL(val)    ((val).as.boolean)
 #define AS_NUM(val)     ((val).as.number)
@@ -2,14 +2,17 @@
 #define VM_H
 
 #include "chunk.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-/** Threshold for ongoing function calls. */
-#define FRAMES_MAX      64
-/** Threshold for stack slots. */
-#define STACK_MAX       (FRAMES_MAX * UINT8_COUNT)
+/** Default threshold for ongoing function calls. */
+#define FRAMES_MAX      0x10000
+/** Initial number of call frames, grown on demand up to `frames_max`. */
+#define FRAMES_INITIAL  64
+/** Initial number of stack slots, grown on demand. */
+#define STACK_INITIAL   (FRAMES_INITIAL * UINT8_COUNT)
 
 /**
  * Represents an ongoing function call.
@@ -26,38 +29,129 @@ typedef struct
     Value*      slots;
 } CallFrame;
 
+/**
+ * Statistics kept by the garbage collector.
+ *
+ * `collections` is the number of times the program was paused to collect
+ *               garbage, slices of incremental collections and compactions
+ *               included.
+ * `full_collections` is the number of collections of the old generation.
+ * `compactions` is the number of times objects were moved to release pages.
+ * `total_pause` is the time spent in those pauses, in seconds.
+ * `max_pause` is the longest of them, in seconds.
+ * `bytes_freed` is the total of bytes the collector freed.
+ * `cycle_freed` is the value of `bytes_freed` when the last collection began.
+ * `high_water` is the most bytes the heap ever took.
+ */
+typedef struct
+{
+    int     collections;
+    int     full_collections;
+    int     compactions;
+    double  total_pause;
+    double  max_pause;
+    size_t  bytes_freed;
+    size_t  cycle_freed;
+    size_t  high_water;
+} GcStats;
+
 /**
  * Structure representing the language's virtual machine.
  * 
  * `frames` is a stack of active function calls.
  * `frame_count` is the current height of the call frame stack.
+ * `frame_capacity` is the length of `frames`.
+ * `frames_max` is the most call frames allowed before a stack overflow.
  * `stack` is the runtime stack.
  * `stack_top` is a pointer to the top of the runtime stack.
+ * `stack_capacity` is the length of `stack`.
  * `strings` is a table of all the strings created in the program.
  * `init_string` is the name of a class' initializer method.
- * `globals` is a table of all the global variables created in a program.
+ * `root_shape` is the shape of instances without fields.
+ * `global_names` is a table mapping the name of every global variable seen by
+ *                the compiler to its slot in `globals`.
+ * `globals` is the array of global variable values, holding `UNDEFINED_VAL`
+ *           in slots of variables not defined yet.
  * `open_upvalues` is a list of upvalues that point to variables in the runtime
  *                 stack.
  * `bytes_allocated` is the total number of bytes the vm allocated.
- * `next_gc` is a threshold for triggering the next collection.
- * `objects` is a linked-list of heap-allocated values.
+ * `next_gc` is a threshold for making the next collection a full one.
+ * `next_minor_gc` is a threshold for triggering the next collection.
+ * `nursery_size` is the number of bytes allocated between two collections.
+ * `grow_factor` is the growth of the heap allowed between two full
+ *               collections.
+ * `max_heap` is the most bytes the heap may take before memory runs out, or
+ *            0 for no limit.
+ * `minor_gc` tells whether the ongoing collection only covers the nursery.
+ * `marking` tells whether an incremental collection is marking objects.
+ * `slice_budget` is the most gray objects an incremental collection traces
+ *                at a time, or 0 to collect without interruption.
+ * `slice_gray_count` is the number of gray objects left by the last slice.
+ * `mark_threads` is the number of threads tracing the objects of a full
+ *                collection, 1 to trace them on the vm's thread alone.
+ * `heap` holds the pages where every object lives.
+ * `sweep_page` is the next page to sweep since the last full collection, or
+ *              `NULL` once the old generation is swept.
+ * `sweep_word` is the next bitmap word to sweep in `sweep_page`.
+ * `background_sweep` tells whether the old generation is swept by a thread of
+ *                    its own after full collections, instead of allocations.
+ * `sweeping` tells whether a sweeper thread is running.
+ * `compact` tells whether the heap is compacted once full collections leave
+ *           it fragmented.
+ * `compact_pending` tells whether the heap is due for a compaction, which
+ *                   waits for the interpreter to reach a safe point.
+ * `young_objects` is a list of the objects allocated since the last
+ *                 collection, known as the nursery.
+ * `young_capacity` is the length of `young_objects`.
+ * `young_count` is the current number of young objects.
+ * `remembered` is a list of old objects that may reference young ones.
+ * `remembered_capacity` is the length of `remembered`.
+ * `remembered_count` is the current number of remembered objects.
+ * `gc_stats` holds the statistics of the garbage collector.
  * `gray_stack` is a list of objects marked by the garbage collector.
  * `gray_capacity` is the length of `grey_stack`.
  * `grey_count` is the current number of grey objects. 
  */
 typedef struct
 {
-    CallFrame   frames[FRAMES_MAX];
+    CallFrame*  frames;
     int         frame_count;
-    Value       stack[STACK_MAX];
+    int         frame_capacity;
+    int         frames_max;
+    Value*      stack;
     Value*      stack_top;
+    int         stack_capacity;
     Table       strings;
     ObjStr*     init_string;
-    Table       globals;
+    ObjShape*   root_shape;
+    Table       global_names;
+    ValueArray  globals;
     ObjUpvalue* open_upvalues;
     size_t      bytes_allocated;
     size_t      next_gc;
-    Obj*        objects;
+    size_t      next_minor_gc;
+    size_t      nursery_size;
+    double      grow_factor;
+    size_t      max_heap;
+    bool        minor_gc;
+    bool        marking;
+    int         slice_budget;
+    int         slice_gray_count;
+    int         mark_threads;
+    Heap        heap;
+    Page*       sweep_page;
+    int         sweep_word;
+    bool        background_sweep;
+    bool        sweeping;
+    bool        compact;
+    bool        compact_pending;
+    Obj**       young_objects;
+    int         young_capacity;
+    int         young_count;
+    Obj**       remembered;
+    int         remembered_capacity;
+    int         remembered_count;
+    GcStats     gc_stats;
     Obj**       gray_stack;
     int         gray_capacity;
     int         gray_count;
@@ -80,14 +174,30 @@ void init_vm();
 void free_vm();
 
 /** Pushes a value specified by `value` onto the runtime stack. */
-void push(Value value);
+static inline void push(Value value)
+{
+    *vm.stack_top = value;
+    vm.stack_top++;
+}
 
 /**
  * Pops a value from the top of the runtime stack. 
  * 
  * Returns the value popped. 
  */
-Value pop();
+static inline Value pop()
+{
+    vm.stack_top--;
+    return *vm.stack_top;
+}
+
+/**
+ * Finds the slot of a global variable specified by `name`, reserving an
+ * undefined one if the name wasn't seen before.
+ * 
+ * Returns the index of the slot in the vm's global array.
+ */
+int global_slot(ObjStr* name);
 
 /**
  * Interprets a program whose content is specified by `source`.
@@ -96,4 +206,11 @@ Value pop();
  */
 InterpretResult interpret(const char* source);
 
+/**
+ * Runs an already compiled top-level function specified by `func`.
+ * 
+ * Returns the interpretation status.
+ */
+InterpretResult interpret_func(ObjFun* func);
+
 #endif
\ No newline at end of file
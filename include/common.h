@@ -6,5 +6,8 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+/* Largest operand of the 24-bit wide opcodes. */
+#define UINT24_MAX ((1 << 24) - 1)
 
 #endif
\ No newline at end of file
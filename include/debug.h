@@ -17,4 +17,11 @@ void disassemble_chunk(Chunk* chunk, const char* name);
  */
 int disassemble_instruction(Chunk* chunk, int offset);
 
+/**
+ * Gets the name of an opcode specified by `op`.
+ *
+ * Returns the name as a static string.
+ */
+const char* opcode_name(uint8_t op);
+
 #endif
\ No newline at end of file
@@ -13,12 +13,43 @@
 #define GROW_ARRAY(type, ptr, old_count, new_count)  \
     (type*)reallocate(ptr, sizeof(type) * old_count, sizeof(type) * new_count)
 
-#define FREE(type, ptr) \
-    reallocate(ptr, sizeof(type), 0)
-
 #define FREE_ARRAY(type, ptr, old_count) \
     reallocate(ptr, sizeof(type) * old_count, 0)
 
+#define FREE_OBJ(type, obj) \
+    free_object((Obj*)(obj), sizeof(type))
+
+
+/**
+ * Takes memory for an object of `size` bytes from the vm's heap, counting the
+ * block or page it takes towards the next collection the way `reallocate` does.
+ *
+ * Returns a pointer to the object's memory.
+ */
+Obj* allocate_object(size_t size);
+
+/**
+ * Gives the memory of an object specified by `obj`, whose size is specified by
+ * `size`, back to the vm's heap.
+ */
+void free_object(Obj* obj, size_t size);
+
+/**
+ * Takes the lock guarding the heap, the pools and `vm.bytes_allocated` while a
+ * sweeper thread runs, unless the current thread holds it already.
+ *
+ * Returns whether the lock was taken, in which case `unlock_heap` releases it.
+ */
+bool lock_heap();
+
+/** Releases the lock taken by `lock_heap`. */
+void unlock_heap();
+
+/**
+ * Reports that memory ran out, either because the system has no more of it or
+ * because the heap would outgrow `vm.max_heap`, and exits.
+ */
+void out_of_memory();
 
 /** Deallocates an object specified by `obj` based on its tag. */
 void free_obj(Obj* obj);
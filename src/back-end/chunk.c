@@ -9,15 +9,21 @@ void init_chunk(Chunk* chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
 }
 
 void free_chunk(Chunk* chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
     init_chunk(chunk);
 }
 
@@ -27,12 +33,50 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line)
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    /* Only bytes emitted from a different line than the previous start a run. */
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line) {
+        return;
+    }
+    if (chunk->line_capacity < chunk->line_count + 1) {
+        int old_capacity = chunk->line_capacity;
+        chunk->line_capacity = GROW_CAPACITY(old_capacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, old_capacity, chunk->line_capacity);
+    }
+    LineStart* start = &chunk->lines[chunk->line_count++];
+    start->offset = chunk->count - 1;
+    start->line = line;
+}
+
+void truncate_chunk(Chunk* chunk, int count)
+{
+    chunk->count = count;
+
+    while (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].offset >= count) {
+        chunk->line_count--;
+    }
+}
+
+int get_line(Chunk* chunk, int offset)
+{
+    /* Binary search for the last run starting at or before the offset. */
+    int low = 0;
+    int high = chunk->line_count - 1;
+
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+
+        if (chunk->lines[mid].offset > offset) {
+            high = mid - 1;
+        } else {
+            low = mid;
+        }
+    }
+    return chunk->lines[low].line;
 }
 
 int add_constant(Chunk* chunk, Value value)
@@ -48,4 +92,16 @@ int add_constant(Chunk* chunk, Value value)
     pop();
 
     return chunk->constants.count - 1;
+}
+
+int add_cache(Chunk* chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        int old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    chunk->caches[chunk->cache_count].count = 0;
+
+    return chunk->cache_count++;
 }
\ No newline at end of file
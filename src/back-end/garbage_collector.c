@@ -1,15 +1,72 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "back-end/garbage_collector.h"
 #include "front-end/compiler.h"
 #include "memory.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+/* Gray objects a marking thread keeps to itself before sharing half of them. */
+#define MARKER_LOCAL_MAX    256
+
+/**
+ * Thread tracing a full collection along with others, each one with a gray
+ * stack of its own.
+ *
+ * `thread` is the thread running the marker, unused by the vm's own one.
+ * `local` is the top of the gray stack, only accessed by the marker itself.
+ * `local_count` is the current number of objects in `local`.
+ * `lock` guards the bottom of the gray stack against other markers.
+ * `shared` is the bottom of the gray stack, which other markers steal from.
+ * `shared_capacity` is the length of `shared`.
+ * `shared_count` is the current number of objects in `shared`, read without
+ *                holding `lock` by markers looking for work.
+ */
+typedef struct
+{
+    pthread_t       thread;
+    Obj*            local[MARKER_LOCAL_MAX];
+    int             local_count;
+    pthread_mutex_t lock;
+    Obj**           shared;
+    int             shared_capacity;
+    int             shared_count;
+} Marker;
+
+static Marker* markers;
+/* Markers still tracing objects, the trace ends once none is. */
+static int active_markers;
+/* Marker running on the current thread while tracing in parallel. */
+static _Thread_local Marker* marker;
+
+/* Thread freeing the dead objects of the last full collection. */
+static pthread_t sweeper;
+/* Set by the sweeper thread once done, for the vm to join it. */
+static bool sweeper_done;
+
+/* Tells whether the ongoing collection must cover the whole heap at once. */
+static bool whole_heap = false;
+
+/** Accounts for a pause of the program lasting from `start` to `end`. */
+static void record_pause(struct timespec* start, struct timespec* end)
+{
+    double pause = (double)(end->tv_sec - start->tv_sec)
+        + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+    vm.gc_stats.collections++;
+    vm.gc_stats.total_pause += pause;
+
+    if (pause > vm.gc_stats.max_pause) {
+        vm.gc_stats.max_pause = pause;
+    }
+}
 
 static void mark_array(ValueArray* array)
 {
@@ -18,12 +75,28 @@ static void mark_array(ValueArray* array)
     }
 }
 
+static void mark_caches(Chunk* chunk)
+{
+    for (int i = 0; i < chunk->cache_count; i++) {
+        InlineCache* cache = &chunk->caches[i];
+
+        for (int j = 0; j < cache->count; j++) {
+            mark_object(cache->entries[j].shape);
+            mark_object(cache->entries[j].class);
+            mark_object(cache->entries[j].target);
+        }
+    }
+}
+
 static void blacken_object(Obj* obj)
 {
 #ifdef DEBUG_LOG_GC
+    /* Lines of markers tracing in parallel are kept whole. */
+    flockfile(stdout);
     printf("%p blacken ", (void*)obj);
     print_value(OBJ_VAL(obj));
     printf("\n");
+    funlockfile(stdout);
 #endif
     switch (obj->type) {
     case OBJ_BOUND_METHOD: {
@@ -51,12 +124,23 @@ static void blacken_object(Obj* obj)
         ObjFun* func = (ObjFun*)obj;
         mark_object((Obj*)func->name);
         mark_array(&func->chunk.constants);
+        mark_caches(&func->chunk);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInst* instance = (ObjInst*)obj;
         mark_object((Obj*)instance->class);
-        mark_table(&instance->fields);
+        mark_object((Obj*)instance->shape);
+
+        for (int i = 0; i < instance->shape->count; i++) {
+            mark_value(instance->fields[i]);
+        }
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)obj;
+        mark_table(&shape->slots);
+        mark_table(&shape->transitions);
         break;
     }
     /* Strings and native function objects contain no outgoing references. */
@@ -84,7 +168,8 @@ static void mark_roots()
     for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue; upvalue = upvalue->next) {
         mark_object((Obj*)upvalue);
     }
-    mark_table(&vm.globals);
+    mark_table(&vm.global_names);
+    mark_array(&vm.globals);
     /*
      * A compiler periodically gets heap memory for literals and its constant
      * table. If garbage collection is triggered while compilation, any values
@@ -92,39 +177,559 @@ static void mark_roots()
      */
     mark_compiler_roots();
     mark_object((Obj*)vm.init_string);
+    mark_object((Obj*)vm.root_shape);
+}
+
+static void mark_remembered()
+{
+    /*
+     * Remembered objects are old or were written to while marking. They
+     * aren't marked themselves, but the objects they reference are.
+     */
+    for (int i = 0; i < vm.remembered_count; i++) {
+        blacken_object(vm.remembered[i]);
+    }
+}
+
+static void forget_remembered()
+{
+    /* Every survivor is old after a collection, so no object needs remembering. */
+    for (int i = 0; i < vm.remembered_count; i++) {
+        vm.remembered[i]->is_remembered = false;
+    }
+    vm.remembered_count = 0;
+}
+
+static void push_shared(Marker* to, Obj** objs, int count)
+{
+    if (to->shared_capacity < to->shared_count + count) {
+        while (to->shared_capacity < to->shared_count + count) {
+            to->shared_capacity = GROW_CAPACITY(to->shared_capacity);
+        }
+        to->shared = (Obj**)realloc(to->shared, sizeof(Obj*) * to->shared_capacity);
+
+        if (!to->shared) {
+            out_of_memory();
+        }
+    }
+    memcpy(to->shared + to->shared_count, objs, sizeof(Obj*) * count);
+    __atomic_store_n(&to->shared_count, to->shared_count + count, __ATOMIC_RELAXED);
+}
+
+static void push_gray(Obj* obj)
+{
+    /*
+     * A full local stack gives its bottom half away, which holds the objects
+     * grayed first and so most likely to lead to many others.
+     */
+    if (marker->local_count == MARKER_LOCAL_MAX) {
+        int half = MARKER_LOCAL_MAX / 2;
+
+        pthread_mutex_lock(&marker->lock);
+        push_shared(marker, marker->local, half);
+        pthread_mutex_unlock(&marker->lock);
+
+        memmove(marker->local, marker->local + half, sizeof(Obj*) * (MARKER_LOCAL_MAX - half));
+        marker->local_count -= half;
+    }
+    marker->local[marker->local_count++] = obj;
+}
+
+/**
+ * Moves half of the shared gray objects of a marker specified by `from` to
+ * the empty local stack of the current one.
+ *
+ * Returns whether any object was moved.
+ */
+static bool take_gray(Marker* from)
+{
+    if (!__atomic_load_n(&from->shared_count, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    pthread_mutex_lock(&from->lock);
+    int count = (from->shared_count + 1) / 2;
+
+    if (count > MARKER_LOCAL_MAX) {
+        count = MARKER_LOCAL_MAX;
+    }
+    int left = from->shared_count - count;
+    memcpy(marker->local, from->shared + left, sizeof(Obj*) * count);
+    __atomic_store_n(&from->shared_count, left, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&from->lock);
+
+    marker->local_count = count;
+
+    return count > 0;
+}
+
+/** Takes gray objects back from the current marker, or else steals some. */
+static bool find_gray()
+{
+    int index = (int)(marker - markers);
+
+    for (int i = 0; i < vm.mark_threads; i++) {
+        if (take_gray(&markers[(index + i) % vm.mark_threads])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool has_shared_gray()
+{
+    for (int i = 0; i < vm.mark_threads; i++) {
+        if (__atomic_load_n(&markers[i].shared_count, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* run_marker(void* arg)
+{
+    marker = (Marker*)arg;
+
+    while (true) {
+        while (marker->local_count > 0) {
+            Obj* obj = marker->local[--marker->local_count];
+            obj->is_gray = false;
+            blacken_object(obj);
+        }
+        if (find_gray()) {
+            continue;
+        }
+        /*
+         * Only active markers share objects, and they share none once out of
+         * work, so the trace is over when no marker is active anymore.
+         */
+        __atomic_sub_fetch(&active_markers, 1, __ATOMIC_SEQ_CST);
+
+        while (true) {
+            if (!__atomic_load_n(&active_markers, __ATOMIC_SEQ_CST)) {
+                marker = NULL;
+                return NULL;
+            }
+            if (has_shared_gray()) {
+                __atomic_add_fetch(&active_markers, 1, __ATOMIC_SEQ_CST);
+
+                if (find_gray()) {
+                    break;
+                }
+                __atomic_sub_fetch(&active_markers, 1, __ATOMIC_SEQ_CST);
+            }
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Traces the gray objects on `vm.mark_threads` threads, the vm's one
+ * included, spreading the gray stack among them to begin with.
+ */
+static void trace_in_parallel()
+{
+    int count = vm.mark_threads;
+    markers = (Marker*)malloc(sizeof(Marker) * count);
+
+    if (!markers) {
+        out_of_memory();
+    }
+    for (int i = 0; i < count; i++) {
+        markers[i].local_count = 0;
+        markers[i].shared = NULL;
+        markers[i].shared_capacity = 0;
+        markers[i].shared_count = 0;
+        pthread_mutex_init(&markers[i].lock, NULL);
+    }
+    for (int i = 0; i < vm.gray_count; i++) {
+        push_shared(&markers[i % count], &vm.gray_stack[i], 1);
+    }
+    vm.gray_count = 0;
+    active_markers = count;
+
+    int started = count;
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&markers[i].thread, NULL, run_marker, &markers[i])) {
+            /*
+             * The markers already started carry on without the others, whose
+             * gray objects they steal like any shared ones.
+             */
+            __atomic_sub_fetch(&active_markers, count - i, __ATOMIC_SEQ_CST);
+            started = i;
+            break;
+        }
+    }
+    run_marker(&markers[0]);
+
+    for (int i = 1; i < started; i++) {
+        pthread_join(markers[i].thread, NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_destroy(&markers[i].lock);
+        free(markers[i].shared);
+    }
+    free(markers);
+    markers = NULL;
 }
 
 static void trace_references()
 {
+    /* Nurseries are small, so only full collections are worth the threads. */
+    if (!vm.minor_gc && vm.mark_threads > 1) {
+        trace_in_parallel();
+        return;
+    }
     while (vm.gray_count > 0) {
         Obj* obj = vm.gray_stack[--vm.gray_count];
+        obj->is_gray = false;
+        blacken_object(obj);
+    }
+}
+
+/**
+ * Blackens at most `budget` gray objects, plus as many as were grayed since
+ * the last slice so that marking keeps ahead of allocation.
+ *
+ * Returns whether the gray stack was emptied.
+ */
+static bool trace_slice(int budget)
+{
+    if (vm.gray_count > vm.slice_gray_count) {
+        budget += vm.gray_count - vm.slice_gray_count;
+    }
+    while (vm.gray_count > 0 && budget-- > 0) {
+        Obj* obj = vm.gray_stack[--vm.gray_count];
+        obj->is_gray = false;
         blacken_object(obj);
     }
+    vm.slice_gray_count = vm.gray_count;
+
+    return vm.gray_count == 0;
+}
+
+/**
+ * Tells whether an object specified by `obj` lies in the part of the heap not
+ * swept yet since the last full collection.
+ */
+static bool is_unswept(Obj* obj)
+{
+    Page* page = PAGE_OF(obj);
+
+    if (!page->unswept) {
+        return false;
+    }
+    return page != vm.sweep_page || (int)(GRANULE_OF(obj) / 64) >= vm.sweep_word;
+}
+
+static void end_sweep()
+{
+    vm.next_gc = (size_t)(vm.bytes_allocated * vm.grow_factor);
+
+    /* Full collections begin before the heap reaches its limit. */
+    if (vm.max_heap > 0 && vm.next_gc > vm.max_heap) {
+        vm.next_gc = vm.max_heap;
+    }
+    if (vm.compact) {
+        int page_count;
+        int spare = heap_spare_pages(&vm.heap, &page_count);
+
+#ifdef DEBUG_STRESS_GC
+        /* Any page to release is enough, so that compactions get stressed too. */
+        vm.compact_pending = spare > 0;
+#else
+        vm.compact_pending = spare >= GC_COMPACT_MIN
+            && spare * GC_COMPACT_RATIO >= page_count;
+#endif
+    }
+#ifdef DEBUG_LOG_GC
+    printf("-- sweep end\n");
+    printf("   next at %zu\n", vm.next_gc);
+#endif
+}
+
+static void sweep(int budget)
+{
+    if (!vm.sweep_page) {
+        return;
+    }
+    /*
+     * Scans the bitmaps of the pages left by the last full collection a word
+     * at a time, moving on before freeing anything, since freeing a large
+     * object releases its page.
+     */
+    while (vm.sweep_page && budget-- > 0) {
+        Page* page = vm.sweep_page;
+        bool large = IS_LARGE_PAGE(page);
+        int word = large ? (int)WORD_OF(LARGE_OBJECT(page)) : vm.sweep_word++;
+
+        if (large || vm.sweep_word == HEAP_BITMAP_WORDS) {
+            page->unswept = false;
+            vm.sweep_page = page->next;
+            vm.sweep_word = 0;
+        }
+        /* Marks are cleared for the next collection without touching objects. */
+        uint64_t unmarked = page->allocated[word] & ~page->marked[word];
+        page->marked[word] = 0;
+
+        while (unmarked) {
+            Obj* obj = PAGE_OBJECT(page, word, lowest_bit(unmarked));
+            unmarked &= unmarked - 1;
+
+            /* Young objects are left to the nursery. */
+            if (obj->is_old) {
+                free_obj(obj);
+            }
+        }
+    }
+    if (!vm.sweep_page) {
+        end_sweep();
+    }
 }
 
-static void sweep()
+static void* run_sweeper(void* arg)
 {
-    Obj* prev = NULL;
-    Obj* obj = vm.objects;
-    /* Traverses the linked list of heap-stored objects from the vm. */
-    while (obj) {
-        /* Marked objects are ignored.*/
-        if (obj->is_marked) {
-            /* Marked objects must be unmarked for the next collection. */
-            obj->is_marked = false;
-            prev = obj;
-            obj = obj->next;
+    Page* page = (Page*)arg;
+
+    /*
+     * Marks stand for dead objects here. The heap is locked a page at a time,
+     * so that the vm can allocate and collect the nursery in between.
+     */
+    while (page) {
+        lock_heap();
+        Page* next = page->next;
+
+        if (IS_LARGE_PAGE(page)) {
+            /* Freeing a large object releases its page along with it. */
+            if (is_marked(LARGE_OBJECT(page))) {
+                free_obj(LARGE_OBJECT(page));
+            }
         } else {
-            Obj* white = obj;
-            obj = obj->next;
+            for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+                uint64_t dead = page->marked[i];
+                page->marked[i] = 0;
+
+                while (dead) {
+                    Obj* obj = PAGE_OBJECT(page, i, lowest_bit(dead));
+                    dead &= dead - 1;
+                    free_obj(obj);
+                }
+            }
+        }
+        unlock_heap();
+        page = next;
+    }
+    __atomic_store_n(&sweeper_done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/** Starts sweeping the old generation once a full collection has marked it. */
+static void start_sweep()
+{
+    if (!vm.background_sweep) {
+        vm.sweep_page = vm.heap.pages;
+        vm.sweep_word = 0;
+        return;
+    }
+    /*
+     * Every object left is old, so the marks turn into the set of dead objects
+     * for the sweeper thread, and the nursery's marks can go in between.
+     * Objects allocated meanwhile are never in that set.
+     */
+    for (Page* page = vm.heap.pages; page; page = page->next) {
+        page->unswept = false;
+
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            page->marked[i] = page->allocated[i] & ~page->marked[i];
+        }
+    }
+    vm.sweeping = true;
+    sweeper_done = false;
+
+    if (pthread_create(&sweeper, NULL, run_sweeper, vm.heap.pages)) {
+        /* Without a thread, the marks go back to live objects, swept lazily. */
+        vm.sweeping = false;
+
+        for (Page* page = vm.heap.pages; page; page = page->next) {
+            page->unswept = true;
 
-            if (prev) {
-                prev->next = obj;
-            } else {
-                vm.objects = obj;
+            for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+                page->marked[i] = page->allocated[i] & ~page->marked[i];
             }
-            free_obj(white);
         }
+        vm.sweep_page = vm.heap.pages;
+        vm.sweep_word = 0;
+    }
+}
+
+static void join_sweeper()
+{
+    pthread_join(sweeper, NULL);
+    vm.sweeping = false;
+    end_sweep();
+}
+
+static void sweep_nursery()
+{
+    /*
+     * Newest objects are freed first, so the free lists hand out blocks in
+     * address order again.
+     */
+    for (int i = vm.young_count - 1; i >= 0; i--) {
+        Obj* obj = vm.young_objects[i];
+
+        if (is_marked(obj)) {
+            /*
+             * Survivors are promoted where they are. Those in a part of the
+             * heap not swept yet keep their mark for the sweep to clear.
+             */
+            if (!is_unswept(obj)) {
+                clear_marked(obj);
+            }
+            obj->is_old = true;
+        } else {
+            /* Full collections already removed the string from the table. */
+            if (obj->type == OBJ_STR && ((ObjStr*)obj)->is_interned
+                && vm.minor_gc) {
+                table_delete(&vm.strings, (ObjStr*)obj);
+            }
+            free_obj(obj);
+        }
+    }
+    vm.young_count = 0;
+}
+
+/* Points a reference specified by `ref` to where its object was moved, if anywhere. */
+#define FORWARD(ref) \
+    ((ref) = (ref) ? (void*)forwarded((Obj*)(ref)) : NULL)
+
+static void forward_value(Value* value)
+{
+    /* Undefined globals are objects without an address. */
+    if (IS_OBJ(*value) && AS_OBJ(*value)) {
+        *value = OBJ_VAL(forwarded(AS_OBJ(*value)));
+    }
+}
+
+static void forward_array(ValueArray* array)
+{
+    for (int i = 0; i < array->count; i++) {
+        forward_value(&array->values[i]);
+    }
+}
+
+static void forward_table(Table* table)
+{
+    for (int i = 0; i < table->size; i++) {
+        Entry* entry = &table->entries[i];
+
+        /* Keys are hashed by content, so entries stay where they are. */
+        FORWARD(entry->key);
+        forward_value(&entry->value);
+    }
+}
+
+static void forward_caches(Chunk* chunk)
+{
+    for (int i = 0; i < chunk->cache_count; i++) {
+        InlineCache* cache = &chunk->caches[i];
+
+        for (int j = 0; j < cache->count; j++) {
+            FORWARD(cache->entries[j].shape);
+            FORWARD(cache->entries[j].class);
+            FORWARD(cache->entries[j].target);
+        }
+    }
+}
+
+/** Updates the references of an object specified by `obj` to objects moved. */
+static void forward_references(Obj* obj)
+{
+    switch (obj->type) {
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = (ObjBoundMethod*)obj;
+        forward_value(&bound->receiver);
+        FORWARD(bound->method);
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* class = (ObjClass*)obj;
+        FORWARD(class->name);
+        forward_table(&class->methods);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)obj;
+        FORWARD(closure->function);
+
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            FORWARD(closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNC: {
+        ObjFun* func = (ObjFun*)obj;
+        FORWARD(func->name);
+        forward_array(&func->chunk.constants);
+        forward_caches(&func->chunk);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInst* instance = (ObjInst*)obj;
+        FORWARD(instance->class);
+        /* The shape is read from where it was moved to, not its old copy. */
+        FORWARD(instance->shape);
+
+        for (int i = 0; i < instance->shape->count; i++) {
+            forward_value(&instance->fields[i]);
+        }
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)obj;
+        forward_table(&shape->slots);
+        forward_table(&shape->transitions);
+        break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STR:
+        break;
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = (ObjUpvalue*)obj;
+        forward_value(&upvalue->closed);
+        FORWARD(upvalue->next);
+
+        /* Closed upvalues point into themselves, wherever they were. */
+        if (upvalue->location < vm.stack
+            || upvalue->location >= vm.stack + vm.stack_capacity) {
+            upvalue->location = &upvalue->closed;
+        }
+        break;
+    }
+    }
+}
+
+static void forward_roots()
+{
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        forward_value(slot);
+    }
+    for (int i = 0; i < vm.frame_count; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+    FORWARD(vm.open_upvalues);
+    forward_table(&vm.global_names);
+    forward_array(&vm.globals);
+    forward_table(&vm.strings);
+    FORWARD(vm.init_string);
+    FORWARD(vm.root_shape);
+
+    for (int i = 0; i < vm.young_count; i++) {
+        FORWARD(vm.young_objects[i]);
+    }
+    for (int i = 0; i < vm.remembered_count; i++) {
+        FORWARD(vm.remembered[i]);
     }
 }
 
@@ -133,15 +738,39 @@ void mark_object(Obj* obj)
     if (!obj)
         return;
 
-    if (obj->is_marked)
+    /* Minor collections take old objects as reachable without tracing them. */
+    if (vm.minor_gc && obj->is_old)
         return;
 
+    /*
+     * Full collections only look at the mark bitmap of marked objects. Markers
+     * race to mark an object, and only the one marking it traces it.
+     */
+    if (marker) {
+        if (!try_mark(obj))
+            return;
+    } else if (is_marked(obj)) {
+        return;
+    }
+
 #ifdef DEBUG_LOG_GC
+    flockfile(stdout);
     printf("%p mark ", (void*)obj);
     print_value(OBJ_VAL(obj));
     printf("\n");
+    funlockfile(stdout);
 #endif
-    obj->is_marked = true;
+    if (marker) {
+        push_gray(obj);
+    } else {
+        gray_object(obj);
+    }
+}
+
+void gray_object(Obj* obj)
+{
+    set_marked(obj);
+    obj->is_gray = true;
 
     if (vm.gray_capacity < vm.gray_count + 1) {
         vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
@@ -149,7 +778,7 @@ void mark_object(Obj* obj)
             (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
 
         if (!vm.gray_stack) {
-            exit(1);
+            out_of_memory();
         }
     }
     vm.gray_stack[vm.gray_count++] = obj;
@@ -167,12 +796,120 @@ void table_remove_white(Table* table)
     for (int i = 0; i < table->size; i++) {
         Entry* entry = &table->entries[i];
 
-        if (entry->key && !entry->key->obj.is_marked) {
+        if (entry->key && !is_marked((Obj*)entry->key)) {
             table_delete(table, entry->key);
         }
     }
 }
 
+void wait_for_sweeper()
+{
+    if (vm.sweeping) {
+        join_sweeper();
+    }
+}
+
+void collect_all_garbage()
+{
+    wait_for_sweeper();
+    whole_heap = true;
+
+    /* Objects allocated while marking incrementally survive it, so it's finished first. */
+    if (vm.marking) {
+        collect_garbage();
+    }
+    collect_garbage();
+    whole_heap = false;
+
+    sweep(INT_MAX);
+    wait_for_sweeper();
+}
+
+void compact_heap()
+{
+    /*
+     * Marks stand for moved objects, so none may be left by a full collection
+     * still going on. Objects allocated since the last one are moved as well,
+     * dead or not.
+     */
+    if (vm.marking || vm.sweep_page || vm.sweeping) {
+        collect_all_garbage();
+    }
+    vm.compact_pending = false;
+
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+#endif
+    int evacuated = heap_evacuate(&vm.heap);
+
+    forward_roots();
+
+    for (Page* page = vm.heap.pages; page; page = page->next) {
+        if (page->evacuated) {
+            continue;
+        }
+        if (IS_LARGE_PAGE(page)) {
+            forward_references(LARGE_OBJECT(page));
+            continue;
+        }
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            for (uint64_t bits = page->allocated[i]; bits; bits &= bits - 1) {
+                forward_references(PAGE_OBJECT(page, i, lowest_bit(bits)));
+            }
+        }
+    }
+    heap_release_evacuated(&vm.heap);
+    vm.gc_stats.compactions++;
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   released %d pages\n", evacuated);
+#else
+    (void)evacuated;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record_pause(&start, &end);
+}
+
+void sweep_slice()
+{
+    if (vm.sweep_page) {
+        sweep(GC_SWEEP_SLICE);
+    }
+}
+
+void add_young(Obj* obj)
+{
+    if (vm.young_capacity < vm.young_count + 1) {
+        vm.young_capacity = GROW_CAPACITY(vm.young_capacity);
+        vm.young_objects =
+            (Obj**)realloc(vm.young_objects, sizeof(Obj*) * vm.young_capacity);
+
+        if (!vm.young_objects) {
+            out_of_memory();
+        }
+    }
+    vm.young_objects[vm.young_count++] = obj;
+}
+
+void remember_object(Obj* obj)
+{
+    if (vm.remembered_capacity < vm.remembered_count + 1) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered =
+            (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+
+        if (!vm.remembered) {
+            out_of_memory();
+        }
+    }
+    obj->is_remembered = true;
+    vm.remembered[vm.remembered_count++] = obj;
+}
+
 void mark_table(Table* table)
 {
     for (int i = 0; i < table->size; i++) {
@@ -183,23 +920,181 @@ void mark_table(Table* table)
     }
 }
 
-void collect_garbage()
+static void collect()
 {
+    if (vm.sweeping && __atomic_load_n(&sweeper_done, __ATOMIC_ACQUIRE)) {
+        join_sweeper();
+    }
+#ifdef DEBUG_STRESS_GC
+    /* Every other collection is a full one, so both kinds get stressed. */
+    static bool full = false;
+
+    if (!vm.marking) {
+        full = !full;
+
+        if (full) {
+            wait_for_sweeper();
+        }
+    }
+#endif
+    /*
+     * Only minor collections happen while a sweeper thread runs, which then
+     * waits for them to end before going on with the next page.
+     */
+    bool locked = lock_heap();
+    vm.gc_stats.cycle_freed = vm.gc_stats.bytes_freed;
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
     /* Heap size before the collection is triggered. */
     size_t before = vm.bytes_allocated;
 #endif
+    if (vm.marking) {
+#ifdef DEBUG_LOG_GC
+        printf("-- gc slice\n");
+#endif
+        if (!trace_slice(whole_heap ? INT_MAX : vm.slice_budget)) {
+            vm.next_minor_gc = vm.bytes_allocated + GC_SLICE_INTERVAL;
+
+            if (locked) {
+                unlock_heap();
+            }
+            return;
+        }
+        /*
+         * The roots and the objects written to while marking may point to
+         * white objects, so they're traced again without interruption.
+         */
+    } else {
+        /* The old generation is only collected again once it's swept. */
+        vm.minor_gc = !whole_heap
+            && (vm.sweep_page || vm.sweeping || vm.bytes_allocated <= vm.next_gc);
+#ifdef DEBUG_STRESS_GC
+        vm.minor_gc = !full && !whole_heap;
+#endif
+#ifdef DEBUG_LOG_GC
+        printf("-- %s begin\n", vm.minor_gc ? "minor gc" : "gc");
+#endif
+        if (!vm.minor_gc) {
+            sweep(INT_MAX);
+        }
+        if (!vm.minor_gc && vm.slice_budget > 0 && !whole_heap) {
+            /* The old generation is marked a slice at a time from now on. */
+            mark_roots();
+            vm.marking = true;
+            vm.slice_gray_count = vm.gray_count;
+            vm.next_minor_gc = vm.bytes_allocated + GC_SLICE_INTERVAL;
+
+            if (locked) {
+                unlock_heap();
+            }
+            return;
+        }
+    }
     mark_roots();
+
+    if (vm.minor_gc || vm.marking) {
+        mark_remembered();
+    }
     trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    forget_remembered();
+
+    if (!vm.minor_gc) {
+        /*
+         * The old generation is swept lazily or in the background from now
+         * on, but dead strings must leave the table before anything looks
+         * them up.
+         */
+        table_remove_white(&vm.strings);
+
+        for (Page* page = vm.heap.pages; page; page = page->next) {
+            page->unswept = true;
+        }
+    }
+    sweep_nursery();
+
+    bool full_gc = !vm.minor_gc;
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (full_gc) {
+        vm.gc_stats.full_collections++;
+    }
+    vm.minor_gc = false;
+    vm.marking = false;
+    vm.next_minor_gc = vm.bytes_allocated + vm.nursery_size;
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     /* Total of memory collected. */
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
         before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
 #endif
+    if (locked) {
+        unlock_heap();
+    }
+    /* Dead young objects may have released their pages, so sweeping starts after. */
+    if (full_gc) {
+        start_sweep();
+    }
 }
+
+void collect_garbage()
+{
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    collect();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record_pause(&start, &end);
+}
+
+void count_objects(int counts[])
+{
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        counts[i] = 0;
+    }
+    bool locked = lock_heap();
+
+    for (Page* page = vm.heap.pages; page; page = page->next) {
+        if (IS_LARGE_PAGE(page)) {
+            counts[LARGE_OBJECT(page)->type]++;
+            continue;
+        }
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            uint64_t bits = page->allocated[i];
+
+            while (bits) {
+                counts[PAGE_OBJECT(page, i, lowest_bit(bits))->type]++;
+                bits &= bits - 1;
+            }
+        }
+    }
+    if (locked) {
+        unlock_heap();
+    }
+}
+
+void print_gc_stats()
+{
+    int counts[OBJ_TYPE_COUNT];
+    count_objects(counts);
+
+    /* A sweeper thread may be freeing objects meanwhile. */
+    bool locked = lock_heap();
+    GcStats stats = vm.gc_stats;
+    size_t heap_size = vm.bytes_allocated;
+
+    if (locked) {
+        unlock_heap();
+    }
+    fprintf(stderr, "-- gc stats\n");
+    fprintf(stderr, "   collections   %d (%d full, %d compacting)\n",
+        stats.collections, stats.full_collections, stats.compactions);
+    fprintf(stderr, "   pauses        %.3f ms total, %.3f ms max\n",
+        stats.total_pause * 1e3, stats.max_pause * 1e3);
+    fprintf(stderr, "   freed         %zu bytes (%zu since the last collection began)\n",
+        stats.bytes_freed, stats.bytes_freed - stats.cycle_freed);
+    fprintf(stderr, "   heap          %zu bytes (%zu at most)\n",
+        heap_size, stats.high_water);
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(stderr, "   %-13s %d\n", obj_type_name((ObjType)i), counts[i]);
+    }
+}
\ No newline at end of file
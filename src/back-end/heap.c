@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "back-end/heap.h"
+#include "memory.h"
+
+/* Classes a granule apart, followed by the ones a quarter of a power of two apart. */
+#define SMALL_CLASSES       (HEAP_SMALL_BLOCK / HEAP_GRANULE)
+/* Power of two of `HEAP_SMALL_BLOCK`. */
+#define SMALL_SHIFT         8
+/* Number of blocks of a size specified by `size` fitting in a page. */
+#define PAGE_BLOCKS(size)   ((int)((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / (size)))
+
+/**
+ * Page of small objects along with the number of them alive, as sorted by a
+ * compaction.
+ */
+typedef struct
+{
+    Page*   page;
+    int     live;
+} PageUse;
+
+/** Returns the size class of the blocks fitting an object of `size` bytes. */
+static int class_of(size_t size)
+{
+    if (size <= HEAP_SMALL_BLOCK) {
+        return (int)((size - 1) / HEAP_GRANULE);
+    }
+    int shift = SMALL_SHIFT;
+
+    while ((size - 1) >> (shift + 1)) {
+        shift++;
+    }
+    /* Sizes past a power of two are split in four steps of a quarter of it. */
+    int step = (int)((size - 1) >> (shift - 2)) - 4;
+
+    return SMALL_CLASSES + (shift - SMALL_SHIFT) * 4 + step;
+}
+
+/** Returns the size of the blocks of a class specified by `size_class`. */
+static size_t class_size(int size_class)
+{
+    if (size_class < SMALL_CLASSES) {
+        return (size_t)(size_class + 1) * HEAP_GRANULE;
+    }
+    int step = size_class - SMALL_CLASSES;
+
+    return (size_t)(5 + step % 4) << (SMALL_SHIFT - 2 + step / 4);
+}
+
+static Page* new_page(Heap* heap, size_t page_size, size_t block_size)
+{
+    Page* page = (Page*)aligned_alloc(HEAP_PAGE_SIZE, page_size);
+
+    if (!page) {
+        out_of_memory();
+    }
+    page->prev = NULL;
+    page->next = heap->pages;
+    page->block_size = block_size;
+    page->unswept = false;
+    page->evacuated = false;
+
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        page->allocated[i] = 0;
+        page->marked[i] = 0;
+    }
+    if (heap->pages) {
+        heap->pages->prev = page;
+    }
+    heap->pages = page;
+
+    return page;
+}
+
+static void unlink_page(Heap* heap, Page* page)
+{
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        heap->pages = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+}
+
+static FreeBlock* refill_class(Heap* heap, int size_class)
+{
+    size_t block_size = class_size(size_class);
+    Page* page = new_page(heap, HEAP_PAGE_SIZE, block_size);
+
+    /* Blocks are linked in address order, so they're handed out that way. */
+    size_t block_count = (HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / block_size;
+    char* start = (char*)page + PAGE_HEADER_SIZE;
+    char* last = start + (block_count - 1) * block_size;
+
+    for (char* block = start; block < last; block += block_size) {
+        ((FreeBlock*)block)->next = (FreeBlock*)(block + block_size);
+    }
+    ((FreeBlock*)last)->next = NULL;
+
+    return (FreeBlock*)start;
+}
+
+static int count_live(Page* page)
+{
+    int live = 0;
+
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        live += count_bits(page->allocated[i]);
+    }
+    return live;
+}
+
+/* Sorts pages by size class, then from the fullest to the sparsest. */
+static int compare_use(const void* a, const void* b)
+{
+    const PageUse* x = (const PageUse*)a;
+    const PageUse* y = (const PageUse*)b;
+
+    if (x->page->block_size != y->page->block_size) {
+        return x->page->block_size < y->page->block_size ? -1 : 1;
+    }
+    return y->live - x->live;
+}
+
+/**
+ * Lists the pages of small objects of a heap specified by `heap`, sorted by
+ * `compare_use`, into a new array whose length is stored in `count`.
+ */
+static PageUse* list_pages(Heap* heap, int* count)
+{
+    *count = 0;
+
+    for (Page* page = heap->pages; page; page = page->next) {
+        if (!IS_LARGE_PAGE(page)) {
+            (*count)++;
+        }
+    }
+    PageUse* pages = (PageUse*)malloc(sizeof(PageUse) * (*count + 1));
+
+    if (!pages) {
+        out_of_memory();
+    }
+    int i = 0;
+
+    for (Page* page = heap->pages; page; page = page->next) {
+        if (!IS_LARGE_PAGE(page)) {
+            pages[i].page = page;
+            pages[i].live = count_live(page);
+            i++;
+        }
+    }
+    qsort(pages, *count, sizeof(PageUse), compare_use);
+
+    return pages;
+}
+
+/**
+ * Finds the end of the run of pages of the same size class starting at a
+ * position specified by `start` in `pages`, along with the number of them
+ * enough to hold every object of the run, stored in `needed`.
+ */
+static int class_end(PageUse* pages, int count, int start, int* needed)
+{
+    size_t block_size = pages[start].page->block_size;
+    int live = 0;
+    int end = start;
+
+    while (end < count && pages[end].page->block_size == block_size) {
+        live += pages[end].live;
+        end++;
+    }
+    *needed = (live + PAGE_BLOCKS(block_size) - 1) / PAGE_BLOCKS(block_size);
+
+    return end;
+}
+
+/* Links the free blocks of a page specified by `page` in address order. */
+static FreeBlock* free_blocks_of(Page* page, FreeBlock* next)
+{
+    char* start = (char*)page + PAGE_HEADER_SIZE;
+
+    for (int i = PAGE_BLOCKS(page->block_size) - 1; i >= 0; i--) {
+        Obj* block = (Obj*)(start + i * page->block_size);
+
+        if (!(page->allocated[WORD_OF(block)] & BIT_OF(block))) {
+            ((FreeBlock*)block)->next = next;
+            next = (FreeBlock*)block;
+        }
+    }
+    return next;
+}
+
+void init_heap(Heap* heap)
+{
+    heap->pages = NULL;
+
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        heap->free_blocks[i] = NULL;
+    }
+}
+
+void free_heap(Heap* heap)
+{
+    while (heap->pages) {
+        Page* next = heap->pages->next;
+        free(heap->pages);
+        heap->pages = next;
+    }
+    init_heap(heap);
+}
+
+size_t heap_block_size(size_t size)
+{
+    if (size > HEAP_MAX_BLOCK) {
+        size_t page_size = PAGE_HEADER_SIZE + size;
+        /* Sizes passed to `aligned_alloc` must be multiples of the alignment. */
+        return (page_size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE * HEAP_PAGE_SIZE;
+    }
+    return class_size(class_of(size));
+}
+
+Obj* heap_alloc(Heap* heap, size_t size)
+{
+    Obj* obj;
+
+    if (size > HEAP_MAX_BLOCK) {
+        size_t page_size = heap_block_size(size);
+        Page* page = new_page(heap, page_size, page_size);
+        obj = LARGE_OBJECT(page);
+    } else {
+        int size_class = class_of(size);
+        FreeBlock* block = heap->free_blocks[size_class];
+
+        if (!block) {
+            block = refill_class(heap, size_class);
+        }
+        heap->free_blocks[size_class] = block->next;
+        obj = (Obj*)block;
+    }
+    PAGE_OF(obj)->allocated[WORD_OF(obj)] |= BIT_OF(obj);
+
+    return obj;
+}
+
+void heap_free(Heap* heap, Obj* obj)
+{
+    Page* page = PAGE_OF(obj);
+
+    if (IS_LARGE_PAGE(page)) {
+        unlink_page(heap, page);
+        free(page);
+        return;
+    }
+    page->allocated[WORD_OF(obj)] &= ~BIT_OF(obj);
+
+    int size_class = class_of(page->block_size);
+    FreeBlock* block = (FreeBlock*)obj;
+    block->next = heap->free_blocks[size_class];
+    heap->free_blocks[size_class] = block;
+}
+
+int heap_spare_pages(Heap* heap, int* page_count)
+{
+    int count;
+    PageUse* pages = list_pages(heap, &count);
+    int spare = 0;
+
+    for (int start = 0; start < count;) {
+        int needed;
+        int end = class_end(pages, count, start, &needed);
+
+        spare += end - start - needed;
+        start = end;
+    }
+    free(pages);
+    *page_count = count;
+
+    return spare;
+}
+
+int heap_evacuate(Heap* heap)
+{
+    int count;
+    PageUse* pages = list_pages(heap, &count);
+    int evacuated = 0;
+
+    for (int start = 0; start < count;) {
+        int needed;
+        int end = class_end(pages, count, start, &needed);
+        size_t block_size = pages[start].page->block_size;
+        int size_class = class_of(block_size);
+
+        if (needed == end - start) {
+            start = end;
+            continue;
+        }
+        /* Only the blocks of the fullest pages are handed out from now on. */
+        FreeBlock* free_blocks = NULL;
+
+        for (int i = start + needed - 1; i >= start; i--) {
+            free_blocks = free_blocks_of(pages[i].page, free_blocks);
+        }
+        for (int i = start + needed; i < end; i++) {
+            Page* page = pages[i].page;
+
+            for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+                for (uint64_t bits = page->allocated[word]; bits; bits &= bits - 1) {
+                    Obj* obj = PAGE_OBJECT(page, word, lowest_bit(bits));
+                    Obj* copy = (Obj*)free_blocks;
+
+                    free_blocks = free_blocks->next;
+                    memcpy(copy, obj, block_size);
+                    PAGE_OF(copy)->allocated[WORD_OF(copy)] |= BIT_OF(copy);
+
+                    *(Obj**)obj = copy;
+                    set_marked(obj);
+                }
+            }
+            page->evacuated = true;
+            evacuated++;
+        }
+        heap->free_blocks[size_class] = free_blocks;
+        start = end;
+    }
+    free(pages);
+
+    return evacuated;
+}
+
+void heap_release_evacuated(Heap* heap)
+{
+    Page* page = heap->pages;
+
+    while (page) {
+        Page* next = page->next;
+
+        if (page->evacuated) {
+            unlink_page(heap, page);
+            free(page);
+        }
+        page = next;
+    }
+}
\ No newline at end of file
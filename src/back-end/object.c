@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "back-end/garbage_collector.h"
 #include "back-end/object.h"
 #include "back-end/table.h"
 #include "back-end/value.h"
@@ -11,17 +12,29 @@
     (type*)allocate_obj(sizeof(type), obj_type)
 
 #define ALLOCATE_STR(len) \
-    (ObjStr*)allocate_obj(sizeof(ObjStr) + sizeof(char[len]), OBJ_STR)
+    (ObjStr*)allocate_obj(sizeof(ObjStr) + sizeof(char[len + 1]), OBJ_STR)
+
+/* Longest concatenation result looked up among the interned strings. */
+#define SHORT_STR_MAX 16
 
 static Obj* allocate_obj(size_t size, ObjType type)
 {
-    Obj* obj = (Obj*)reallocate(NULL, 0, size);
+    /* Dead objects are freed right before their memory is asked for again. */
+    sweep_slice();
+
+    Obj* obj = allocate_object(size);
     obj->type = type;
-    /* Every new object begins unmarked. */
-    obj->is_marked = false;
-    /* Every new object allocation is tracked by the vm. */
-    obj->next = vm.objects;
-    vm.objects = obj;
+    /* Every new object begins unmarked, which its block already is. */
+    obj->is_gray = false;
+    obj->is_old = false;
+    obj->is_remembered = false;
+    /* Every new object is allocated in the nursery. */
+    add_young(obj);
+
+    /* Objects allocated while marking incrementally are traced before it ends. */
+    if (vm.marking) {
+        gray_object(obj);
+    }
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)obj, size, type);
 #endif
@@ -42,6 +55,7 @@ ObjClass* new_class(ObjStr* name)
     ObjClass* class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     class->name = name;
     init_table(&class->methods);
+    class->version = 0;
 
     return class;
 }
@@ -76,6 +90,7 @@ ObjFun* new_func()
     ObjFun* func = ALLOCATE_OBJ(ObjFun, OBJ_FUNC);
     func->upvalue_count = 0;
     func->arity = 0;
+    func->max_stack = 0;
     func->name = NULL;
     init_chunk(&func->chunk);
 
@@ -86,11 +101,82 @@ ObjInst* new_instance(ObjClass* class)
 {
     ObjInst* instance = ALLOCATE_OBJ(ObjInst, OBJ_INSTANCE);
     instance->class = class;
-    init_table(&instance->fields);
+    instance->shape = vm.root_shape;
+    instance->capacity = 0;
+    instance->fields = NULL;
 
     return instance;
 }
 
+ObjShape* new_shape()
+{
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->count = 0;
+    init_table(&shape->slots);
+    init_table(&shape->transitions);
+
+    return shape;
+}
+
+int shape_find(ObjShape* shape, ObjStr* name)
+{
+    Value index;
+
+    if (!table_get(&shape->slots, name, &index)) {
+        return -1;
+    }
+    return (int)AS_NUM(index);
+}
+
+static ObjShape* shape_transition(ObjShape* shape, ObjStr* name)
+{
+    Value next;
+
+    if (table_get(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+    ObjShape* child = new_shape();
+    /*
+     * The new shape is pushed onto the runtime stack to avoid collection while
+     * its tables are filled.
+     */
+    push(OBJ_VAL(child));
+    table_add_all(&shape->slots, &child->slots);
+    table_set(&child->slots, name, NUM_VAL(shape->count));
+    write_barrier((Obj*)child);
+    child->count = shape->count + 1;
+    table_set(&shape->transitions, name, OBJ_VAL(child));
+    write_barrier((Obj*)shape);
+    pop();
+
+    return child;
+}
+
+int set_field(ObjInst* instance, ObjStr* name, Value value)
+{
+    int index = shape_find(instance->shape, name);
+
+    if (index != -1) {
+        instance->fields[index] = value;
+        write_barrier_value((Obj*)instance, value);
+        return index;
+    }
+    index = instance->shape->count;
+
+    if (instance->capacity < index + 1) {
+        int old_capacity = instance->capacity;
+        instance->capacity = GROW_CAPACITY(old_capacity);
+        instance->fields = GROW_ARRAY(Value, instance->fields,
+            old_capacity, instance->capacity);
+    }
+    /* The new slot isn't visible to the collector until the shape changes. */
+    instance->fields[index] = value;
+    instance->shape = shape_transition(instance->shape, name);
+    write_barrier((Obj*)instance);
+
+    return index;
+}
+
 ObjNative* new_native(NativeFun fun)
 {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
@@ -99,12 +185,14 @@ ObjNative* new_native(NativeFun fun)
     return native;
 }
 
-static ObjStr* allocate_str(char* chars, int len, uint32_t hash)
+static ObjStr* allocate_str(const char* chars, int len, uint32_t hash)
 {
     ObjStr* str = ALLOCATE_STR(len);
     str->hash = hash;
     str->length = len;
+    str->is_interned = true;
     memcpy(str->chars, chars, len);
+    str->chars[len] = '\0';
     /*
      * The string is pushed onto the runtime stack to avoid collection if it is
      * triggered while resizing the interned strings table.
@@ -117,8 +205,39 @@ static ObjStr* allocate_str(char* chars, int len, uint32_t hash)
     return str;
 }
 
+#ifndef FNV_HASH
+
+/* Odd constant with well spread bits, from the wyhash family of functions. */
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15u
+
+/** Reads 8 unaligned bytes at `chars`. */
+static inline uint64_t read_64(const char* chars)
+{
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+/** Reads 4 unaligned bytes at `chars`. */
+static inline uint64_t read_32(const char* chars)
+{
+    uint32_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+/** Folds a word specified by `word` into a hash specified by `hash`. */
+static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    return hash ^ (hash >> 29);
+}
+
+#endif
+
 static uint32_t hash_str(const char* key, int len)
 {
+#ifdef FNV_HASH
     /* FNV-1a hash. */
     uint32_t hash = 2166136261u;
 
@@ -127,19 +246,70 @@ static uint32_t hash_str(const char* key, int len)
         hash *= 16777619;
     }
     return hash;
+#else
+    /*
+     * Eight bytes are folded in at a time. Whatever doesn't fill a word is
+     * read with fixed-size loads overlapping the bytes already read, as done
+     * by wyhash, and the length seeds the hash to tell overlaps apart.
+     */
+    uint64_t hash = (uint64_t)len * HASH_MULTIPLIER;
+
+    if (len >= 8) {
+        for (int i = 0; i < len - 8; i += 8) {
+            hash = hash_word(hash, read_64(key + i));
+        }
+        hash = hash_word(hash, read_64(key + len - 8));
+    } else if (len >= 4) {
+        hash = hash_word(hash, (read_32(key) << 32) | read_32(key + len - 4));
+    } else if (len > 0) {
+        hash = hash_word(hash, ((uint64_t)(uint8_t)key[0] << 16)
+            | ((uint64_t)(uint8_t)key[len >> 1] << 8) | (uint8_t)key[len - 1]);
+    }
+    /* Tables index by the low bits, which must depend on every byte. */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+
+    return (uint32_t)hash;
+#endif
 }
 
-ObjStr* take_str(char* data, int len)
+ObjStr* join_str(ObjStr* a, ObjStr* b)
 {
-    uint32_t hash = hash_str(data, len);
-    ObjStr* interned = table_find(&vm.strings, data, len, hash);
+    /* Strings are immutable, so an operand can stand for the result. */
+    if (!a->length) {
+        return b;
+    }
+    if (!b->length) {
+        return a;
+    }
+    int len = a->length + b->length;
 
-    if (interned) {
-        /* Duplicate string is no longer needed. */
-        FREE_ARRAY(char, data, len + 1);
-        return interned;
+    if (len <= SHORT_STR_MAX) {
+        /*
+         * Short results are cheap to hash and often equal to a literal or a
+         * name, whose object is shared instead of allocating another.
+         */
+        char chars[SHORT_STR_MAX];
+        memcpy(chars, a->chars, a->length);
+        memcpy(chars + a->length, b->chars, b->length);
+
+        return copy_str(chars, len);
     }
-    return allocate_str(data, len, hash);
+    /*
+     * Neither hashed nor looked up in the string table, which would take time
+     * linear in the length of every intermediate result of a string built
+     * piece by piece.
+     */
+    ObjStr* str = ALLOCATE_STR(len);
+    str->hash = 0;
+    str->length = len;
+    str->is_interned = false;
+    memcpy(str->chars, a->chars, a->length);
+    memcpy(str->chars + a->length, b->chars, b->length);
+    str->chars[len] = '\0';
+
+    return str;
 }
 
 ObjStr* copy_str(const char* chars, int len)
@@ -150,11 +320,8 @@ ObjStr* copy_str(const char* chars, int len)
     if (interned) {
         return interned;
     }
-    char* heap_chars = ALLOCATE(char, len + 1);
-    memcpy(heap_chars, chars, len);
-    heap_chars[len] = '\0';
-
-    return allocate_str(heap_chars, len, hash);
+    /* Characters are copied straight into the object. */
+    return allocate_str(chars, len, hash);
 }
 
 static void print_func(ObjFun* func)
@@ -166,6 +333,22 @@ static void print_func(ObjFun* func)
     printf(" <fn %s>", func->name->chars);
 }
 
+const char* obj_type_name(ObjType type)
+{
+    static const char* names[OBJ_TYPE_COUNT] = {
+        [OBJ_BOUND_METHOD] = "boundMethods",
+        [OBJ_CLASS] = "classes",
+        [OBJ_CLOSURE] = "closures",
+        [OBJ_FUNC] = "functions",
+        [OBJ_INSTANCE] = "instances",
+        [OBJ_NATIVE] = "natives",
+        [OBJ_SHAPE] = "shapes",
+        [OBJ_STR] = "strings",
+        [OBJ_UPVALUE] = "upvalues",
+    };
+    return names[type];
+}
+
 void print_obj(Value value)
 {
     switch (OBJ_TYPE(value)) {
@@ -187,6 +370,9 @@ void print_obj(Value value)
     case OBJ_NATIVE:
         printf("<native fn>");
         break;
+    case OBJ_SHAPE:
+        printf("shape");
+        break;
     case OBJ_STR:
         printf("%s", AS_CSTR(value));
         break;
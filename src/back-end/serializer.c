@@ -0,0 +1,895 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "back-end/garbage_collector.h"
+#include "back-end/serializer.h"
+#include "back-end/vm.h"
+#include "memory.h"
+
+/* Kinds of constants stored in a chunk's constant table. */
+typedef enum
+{
+    CONST_NUM,
+    CONST_STR,
+    CONST_FUNC
+} ConstTag;
+
+/**
+ * Fixed-size header at the start of every bytecode file.
+ *
+ * `magic` is the file signature, "LOXC".
+ * `version` is the `BYTECODE_VERSION` of the build that wrote the file.
+ * `source_hash` is the hash of the source the script was compiled from.
+ * `source_length` is the length of that source.
+ * `payload_hash` is the hash of everything following the header.
+ * `payload_size` is the number of bytes following the header.
+ */
+typedef struct
+{
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    source_hash;
+    uint32_t    source_length;
+    uint32_t    payload_hash;
+    uint32_t    payload_size;
+} Header;
+
+/**
+ * Growable byte buffer the payload is written to before the header, which
+ * depends on its hash.
+ */
+typedef struct
+{
+    size_t      count;
+    size_t      capacity;
+    uint8_t*    bytes;
+    bool        failed;
+} Writer;
+
+/**
+ * Cursor over the mapped payload. Every read is bounds checked, setting
+ * `failed` instead of reading past `end`.
+ *
+ * `global_count` is the number of global slots the script's code may refer to.
+ * `nesting` is the number of functions being read that enclose the next one.
+ */
+typedef struct
+{
+    const uint8_t*  at;
+    const uint8_t*  end;
+    bool            failed;
+    int             global_count;
+    int             nesting;
+} Reader;
+
+/**
+ * Instruction of a loaded function, as decoded by `decode_instruction`.
+ *
+ * `length` is the number of bytes it takes, operands included.
+ * `pops` is the number of values it needs on the stack, which it takes off.
+ * `pushes` is the number of values it leaves in their place.
+ * `peak` is the most values it holds at once in their place while it runs.
+ * `local` is the highest local slot it uses, or -1 if none.
+ * `target` is the position it may jump to, or -1 if it doesn't jump.
+ * `falls_through` tells whether it may carry on with the next instruction.
+ */
+typedef struct
+{
+    int     length;
+    int     pops;
+    int     pushes;
+    int     peak;
+    int     local;
+    int     target;
+    bool    falls_through;
+} Instruction;
+
+/* Flag of each byte of a function's code starting an instruction. */
+#define CODE_START          0x1
+/*
+ * Functions a loaded one may be nested in, which bounds the recursion of the
+ * loader. The compiler has no such limit, but no script comes close to it.
+ */
+#define FUNC_NESTING_MAX    1024
+
+static uint32_t hash_bytes(const void* data, size_t len)
+{
+    /* FNV-1a hash, the same one used by strings. */
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void write_bytes(Writer* writer, const void* data, size_t len)
+{
+    if (writer->count + len > writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity : 1024;
+
+        while (writer->count + len > capacity) {
+            capacity *= 2;
+        }
+        uint8_t* bytes = (uint8_t*)realloc(writer->bytes, capacity);
+
+        if (!bytes) {
+            writer->failed = true;
+            return;
+        }
+        writer->bytes = bytes;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->count, data, len);
+    writer->count += len;
+}
+
+static void write_u32(Writer* writer, uint32_t value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_str(Writer* writer, ObjStr* str)
+{
+    write_u32(writer, (uint32_t)str->length);
+    write_bytes(writer, str->chars, str->length);
+}
+
+static void write_lines(Writer* writer, Chunk* chunk)
+{
+    write_u32(writer, (uint32_t)chunk->line_count);
+
+    for (int i = 0; i < chunk->line_count; i++) {
+        write_u32(writer, (uint32_t)chunk->lines[i].offset);
+        write_u32(writer, (uint32_t)chunk->lines[i].line);
+    }
+}
+
+static void write_func(Writer* writer, ObjFun* func)
+{
+    Chunk* chunk = &func->chunk;
+
+    write_u32(writer, (uint32_t)func->arity);
+    write_u32(writer, (uint32_t)func->upvalue_count);
+    write_u32(writer, (uint32_t)func->max_stack);
+    write_u32(writer, func->name != NULL);
+
+    if (func->name) {
+        write_str(writer, func->name);
+    }
+    write_u32(writer, (uint32_t)chunk->count);
+    write_bytes(writer, chunk->code, chunk->count);
+    write_lines(writer, chunk);
+    write_u32(writer, (uint32_t)chunk->cache_count);
+    write_u32(writer, (uint32_t)chunk->constants.count);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+
+        if (IS_NUM(constant)) {
+            double num = AS_NUM(constant);
+            write_u32(writer, CONST_NUM);
+            write_bytes(writer, &num, sizeof(num));
+        } else if (IS_STR(constant)) {
+            write_u32(writer, CONST_STR);
+            write_str(writer, AS_STR(constant));
+        } else if (IS_FUNC(constant)) {
+            write_u32(writer, CONST_FUNC);
+            write_func(writer, AS_FUNC(constant));
+        } else {
+            /* The compiler doesn't emit any other kind of constant. */
+            writer->failed = true;
+        }
+    }
+}
+
+static void write_globals(Writer* writer)
+{
+    /* Slots are written in order, so they can be reserved again the same way. */
+    ObjStr** names = (ObjStr**)calloc(vm.globals.count, sizeof(ObjStr*));
+
+    if (!names && vm.globals.count > 0) {
+        writer->failed = true;
+        return;
+    }
+    for (int i = 0; i < vm.global_names.size; i++) {
+        Entry* entry = &vm.global_names.entries[i];
+
+        if (entry->key) {
+            names[(int)AS_NUM(entry->value)] = entry->key;
+        }
+    }
+    write_u32(writer, (uint32_t)vm.globals.count);
+
+    for (int i = 0; i < vm.globals.count; i++) {
+        write_str(writer, names[i]);
+    }
+    free(names);
+}
+
+bool save_bytecode(const char* path, const char* source, ObjFun* script)
+{
+    Writer writer = {0, 0, NULL, false};
+    write_globals(&writer);
+    write_func(&writer, script);
+
+    if (writer.failed) {
+        fprintf(stderr, "Could not serialize the script.\n");
+        free(writer.bytes);
+        return false;
+    }
+    size_t source_length = strlen(source);
+    Header header = {
+        {'L', 'O', 'X', 'C'},
+        BYTECODE_VERSION,
+        hash_bytes(source, source_length),
+        (uint32_t)source_length,
+        hash_bytes(writer.bytes, writer.count),
+        (uint32_t)writer.count
+    };
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        free(writer.bytes);
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    written = !fclose(file) && written;
+    free(writer.bytes);
+
+    if (!written) {
+        fprintf(stderr, "Could not write file \"%s\".\n", path);
+    }
+    return written;
+}
+
+static const uint8_t* read_bytes(Reader* reader, size_t len)
+{
+    if (reader->failed || len > (size_t)(reader->end - reader->at)) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->at;
+    reader->at += len;
+
+    return bytes;
+}
+
+static uint32_t read_u32(Reader* reader)
+{
+    uint32_t value = 0;
+    const uint8_t* bytes = read_bytes(reader, sizeof(value));
+
+    if (bytes) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+/** Reads a count, failing if it can't be an `int`. */
+static int read_count(Reader* reader)
+{
+    uint32_t count = read_u32(reader);
+
+    if (count > INT32_MAX) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int)count;
+}
+
+static ObjStr* read_str(Reader* reader)
+{
+    int len = read_count(reader);
+    const uint8_t* chars = read_bytes(reader, len);
+
+    return (chars) ? copy_str((const char*)chars, len) : NULL;
+}
+
+/** Reads a big-endian operand of a width specified by `width`, as the vm does. */
+static int read_operand(Reader* reader, int width)
+{
+    const uint8_t* bytes = read_bytes(reader, width);
+    int value = 0;
+
+    for (int i = 0; bytes && i < width; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+static bool is_name(Chunk* chunk, int constant)
+{
+    return constant < chunk->constants.count && IS_STR(chunk->constants.values[constant]);
+}
+
+/** Sets the stack effect of an instruction specified by `instr`. */
+static void set_effect(Instruction* instr, int pops, int pushes)
+{
+    instr->pops = pops;
+    instr->pushes = pushes;
+}
+
+/** Accounts for a local slot specified by `slot` read, written or captured by `instr`. */
+static void use_local(Instruction* instr, int slot)
+{
+    if (slot > instr->local) {
+        instr->local = slot;
+    }
+}
+
+/**
+ * Decodes the instruction at a position specified by `offset` in the code of
+ * a function specified by `func` into `instr`, with the operand widths of the
+ * disassembler. Constants, names, caches, upvalues and globals are checked
+ * against the function's tables and a number of global slots specified by
+ * `global_count`. Locals depend on the stack, so they're left to the caller.
+ *
+ * Returns whether the instruction is valid or not.
+ */
+static bool decode_instruction(ObjFun* func, int offset, int global_count, Instruction* instr)
+{
+    Chunk* chunk = &func->chunk;
+    Reader code = {chunk->code + offset, chunk->code + chunk->count, false, 0, 0};
+    uint8_t op = (uint8_t)read_operand(&code, 1);
+    bool valid = true;
+    bool wide = false;
+
+    instr->pops = 0;
+    instr->pushes = 0;
+    instr->peak = 0;
+    instr->local = -1;
+    instr->target = -1;
+    instr->falls_through = true;
+
+    switch (op) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        set_effect(instr, 0, 1);
+        break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        set_effect(instr, 2, 1);
+        break;
+    case OP_NOT:
+    case OP_NEGATE:
+        set_effect(instr, 1, 1);
+        break;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+        set_effect(instr, 1, 0);
+        break;
+    case OP_INHERIT:
+        set_effect(instr, 2, 1);
+        break;
+    case OP_RETURN:
+        set_effect(instr, 1, 0);
+        instr->falls_through = false;
+        break;
+    case OP_CONSTANT:
+        valid = read_operand(&code, 1) < chunk->constants.count;
+        set_effect(instr, 0, 1);
+        break;
+    case OP_CONSTANT_LONG:
+        valid = read_operand(&code, 3) < chunk->constants.count;
+        set_effect(instr, 0, 1);
+        break;
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+        wide = true;
+        /* fall through */
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        use_local(instr, read_operand(&code, wide ? 2 : 1));
+        /* Setting a local leaves the value on the stack as well. */
+        if (op == OP_GET_LOCAL || op == OP_GET_LOCAL_LONG) {
+            set_effect(instr, 0, 1);
+        } else {
+            set_effect(instr, 1, 1);
+        }
+        break;
+    case OP_SET_LOCAL_POP:
+        use_local(instr, read_operand(&code, 1));
+        set_effect(instr, 1, 0);
+        break;
+    case OP_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+        wide = true;
+        /* fall through */
+    case OP_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        valid = read_operand(&code, wide ? 2 : 1) < global_count;
+
+        if (op == OP_GLOBAL || op == OP_GLOBAL_LONG) {
+            set_effect(instr, 1, 0);
+        } else if (op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG) {
+            set_effect(instr, 0, 1);
+        } else {
+            set_effect(instr, 1, 1);
+        }
+        break;
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+        wide = true;
+        /* fall through */
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        valid = read_operand(&code, wide ? 2 : 1) < func->upvalue_count;
+
+        if (op == OP_GET_UPVALUE || op == OP_GET_UPVALUE_LONG) {
+            set_effect(instr, 0, 1);
+        } else {
+            set_effect(instr, 1, 1);
+        }
+        break;
+    case OP_CALL:
+        /* The callee and the arguments are replaced by the result. */
+        set_effect(instr, read_operand(&code, 1) + 1, 1);
+        break;
+    case OP_CLASS_LONG:
+        wide = true;
+        /* fall through */
+    case OP_CLASS:
+        valid = is_name(chunk, read_operand(&code, wide ? 2 : 1));
+        set_effect(instr, 0, 1);
+        break;
+    case OP_GET_SUPER_LONG:
+    case OP_METHOD_LONG:
+        wide = true;
+        /* fall through */
+    case OP_GET_SUPER:
+    case OP_METHOD:
+        /* The receiver or the class stays, under the superclass or the method. */
+        valid = is_name(chunk, read_operand(&code, wide ? 2 : 1));
+        set_effect(instr, 2, 1);
+        break;
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+        wide = true;
+        /* fall through */
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_POP:
+        valid = is_name(chunk, read_operand(&code, wide ? 2 : 1))
+            && read_operand(&code, 2) < chunk->cache_count;
+
+        if (op == OP_GET_PROPERTY || op == OP_GET_PROPERTY_LONG) {
+            set_effect(instr, 1, 1);
+        } else {
+            set_effect(instr, 2, (op == OP_SET_PROPERTY_POP) ? 0 : 1);
+        }
+        break;
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+        wide = true;
+        /* fall through */
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: {
+        valid = is_name(chunk, read_operand(&code, wide ? 2 : 1));
+        int args = read_operand(&code, 1);
+        valid = read_operand(&code, 2) < chunk->cache_count && valid;
+        /* The receiver and the arguments, along with the superclass if any. */
+        bool super = op == OP_SUPER_INVOKE || op == OP_SUPER_INVOKE_LONG;
+        set_effect(instr, args + (super ? 2 : 1), 1);
+        break;
+    }
+    case OP_GET_LOCAL_PROPERTY:
+        use_local(instr, read_operand(&code, 1));
+        valid = is_name(chunk, read_operand(&code, 1));
+        valid = read_operand(&code, 2) < chunk->cache_count && valid;
+        set_effect(instr, 0, 1);
+        break;
+    case OP_ADD_LOCALS:
+        use_local(instr, read_operand(&code, 1));
+        use_local(instr, read_operand(&code, 1));
+        set_effect(instr, 0, 1);
+        instr->peak = 2;
+        break;
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUBTRACT_LOCAL_CONST:
+        use_local(instr, read_operand(&code, 1));
+        valid = read_operand(&code, 1) < chunk->constants.count;
+        set_effect(instr, 0, 1);
+        instr->peak = 2;
+        break;
+    case OP_LESS_LOCAL_CONST_JUMP:
+    case OP_GREATER_LOCAL_CONST_JUMP: {
+        use_local(instr, read_operand(&code, 1));
+        valid = read_operand(&code, 1) < chunk->constants.count;
+        int jump = read_operand(&code, 2);
+        instr->target = (int)(code.at - chunk->code) + jump;
+        /* The comparison stays on the stack either way. */
+        set_effect(instr, 0, 1);
+        instr->peak = 2;
+        break;
+    }
+    case OP_JUMP:
+    case OP_JUMP_FALSE: {
+        int jump = read_operand(&code, 2);
+        instr->target = (int)(code.at - chunk->code) + jump;
+        instr->falls_through = op == OP_JUMP_FALSE;
+        /* A condition stays on the stack, but must be there to be tested. */
+        set_effect(instr, (op == OP_JUMP_FALSE) ? 1 : 0, (op == OP_JUMP_FALSE) ? 1 : 0);
+        break;
+    }
+    case OP_LOOP: {
+        int jump = read_operand(&code, 2);
+        instr->target = (int)(code.at - chunk->code) - jump;
+        instr->falls_through = false;
+        break;
+    }
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+        int constant = read_operand(&code, (op == OP_CLOSURE) ? 1 : 3);
+        set_effect(instr, 0, 1);
+
+        if (constant >= chunk->constants.count || !IS_FUNC(chunk->constants.values[constant])) {
+            valid = false;
+            break;
+        }
+        ObjFun* nested = AS_FUNC(chunk->constants.values[constant]);
+
+        /* Captures come from this function's locals or its own upvalues. */
+        for (int i = 0; valid && i < nested->upvalue_count; i++) {
+            int is_local = read_operand(&code, 1);
+            int index = read_operand(&code, 2);
+
+            if (is_local) {
+                use_local(instr, index);
+            } else {
+                valid = index < func->upvalue_count;
+            }
+        }
+        break;
+    }
+    default:
+        valid = false;
+        break;
+    }
+    instr->length = (int)(code.at - (chunk->code + offset));
+
+    if (instr->peak < instr->pushes) {
+        instr->peak = instr->pushes;
+    }
+    return valid && !code.failed;
+}
+
+/**
+ * Carries a stack depth specified by `depth` over to the instruction at a
+ * position specified by `offset`, queuing it in `work` the first time it's
+ * reached. Every path reaching an instruction must agree on its depth.
+ *
+ * Returns whether the offset starts an instruction that agrees.
+ */
+static bool flow_to(const uint8_t* flags, int* depths, int* work, int* work_count,
+    int count, int offset, int depth)
+{
+    if (offset < 0 || offset >= count || !(flags[offset] & CODE_START)) {
+        return false;
+    }
+    if (depths[offset] < 0) {
+        depths[offset] = depth;
+        work[(*work_count)++] = offset;
+        return true;
+    }
+    return depths[offset] == depth;
+}
+
+/**
+ * Checks the code of a function specified by `func` in two passes. The first
+ * one decodes every instruction in order, checking their operands. The second
+ * one follows the control flow from the start with the stack depth of every
+ * instruction, which must never drop below what an instruction pops or the
+ * local slots it uses, nor run off the end of the code. The deepest the stack
+ * gets replaces the function's `max_stack`, which the vm trusts to reserve
+ * its frames.
+ *
+ * Returns whether the code is valid or not.
+ */
+static bool check_code(ObjFun* func, int global_count)
+{
+    int count = func->chunk.count;
+
+    if (count == 0) {
+        return false;
+    }
+    uint8_t* flags = (uint8_t*)calloc(count, sizeof(uint8_t));
+    int* depths = (int*)malloc(sizeof(int) * count);
+    int* work = (int*)malloc(sizeof(int) * count);
+    bool valid = flags && depths && work;
+    Instruction instr;
+
+    for (int offset = 0; valid && offset < count; offset += instr.length) {
+        flags[offset] |= CODE_START;
+        valid = decode_instruction(func, offset, global_count, &instr);
+    }
+    int work_count = 0;
+    int max_stack = func->arity + 1;
+
+    for (int i = 0; valid && i < count; i++) {
+        depths[i] = -1;
+    }
+    /* Slot zero holds the callee, followed by the arguments. */
+    valid = valid && flow_to(flags, depths, work, &work_count, count, 0, func->arity + 1);
+
+    while (valid && work_count > 0) {
+        int offset = work[--work_count];
+        int depth = depths[offset];
+        decode_instruction(func, offset, global_count, &instr);
+
+        if (depth < instr.pops || instr.local >= depth) {
+            valid = false;
+            break;
+        }
+        int base = depth - instr.pops;
+
+        if (base + instr.peak > max_stack) {
+            max_stack = base + instr.peak;
+        }
+        if (instr.falls_through) {
+            valid = flow_to(flags, depths, work, &work_count, count,
+                offset + instr.length, base + instr.pushes);
+        }
+        if (valid && instr.target >= 0) {
+            valid = flow_to(flags, depths, work, &work_count, count,
+                instr.target, base + instr.pushes);
+        }
+    }
+    if (valid) {
+        func->max_stack = max_stack;
+    }
+    free(flags);
+    free(depths);
+    free(work);
+
+    return valid;
+}
+
+static ObjFun* read_func(Reader* reader)
+{
+    /* The function stays on the stack while its parts are allocated. */
+    ObjFun* func = new_func();
+    push(OBJ_VAL(func));
+
+    Chunk* chunk = &func->chunk;
+    func->arity = read_count(reader);
+    func->upvalue_count = read_count(reader);
+    /* The stored depth isn't trusted, `check_code` works it out again. */
+    read_count(reader);
+
+    if (func->arity > UINT8_MAX) {
+        reader->failed = true;
+    }
+
+    if (read_u32(reader)) {
+        func->name = read_str(reader);
+        write_barrier((Obj*)func);
+    }
+    int count = read_count(reader);
+    const uint8_t* code = read_bytes(reader, count);
+
+    if (reader->failed) {
+        pop();
+        return NULL;
+    }
+    uint8_t* code_copy = ALLOCATE(uint8_t, count);
+    memcpy(code_copy, code, count);
+    chunk->code = code_copy;
+    chunk->capacity = count;
+    chunk->count = count;
+
+    int line_count = read_count(reader);
+
+    /* Each run takes two words, which bounds the allocation by the file size. */
+    if ((line_count > 0) != (count > 0) || line_count > (reader->end - reader->at) / 8) {
+        reader->failed = true;
+    } else if (line_count > 0) {
+        LineStart* lines = ALLOCATE(LineStart, line_count);
+
+        for (int i = 0; i < line_count; i++) {
+            lines[i].offset = read_count(reader);
+            lines[i].line = read_count(reader);
+            /* Runs must cover the code from its start, in ascending order. */
+            int previous = (i > 0) ? lines[i - 1].offset : -1;
+            reader->failed |= (i == 0 && lines[i].offset != 0)
+                || lines[i].offset <= previous || lines[i].offset >= count;
+        }
+        chunk->lines = lines;
+        chunk->line_capacity = line_count;
+        chunk->line_count = line_count;
+    }
+    int cache_count = read_count(reader);
+
+    if (cache_count > UINT16_COUNT) {
+        reader->failed = true;
+    } else if (cache_count > 0) {
+        InlineCache* caches = ALLOCATE(InlineCache, cache_count);
+
+        for (int i = 0; i < cache_count; i++) {
+            caches[i].count = 0;
+        }
+        chunk->caches = caches;
+        chunk->cache_capacity = cache_count;
+        chunk->cache_count = cache_count;
+    }
+    int constant_count = read_count(reader);
+
+    for (int i = 0; i < constant_count && !reader->failed; i++) {
+        Value constant = NIL_VAL;
+
+        switch (read_u32(reader)) {
+        case CONST_NUM: {
+            double num = 0;
+            const uint8_t* bytes = read_bytes(reader, sizeof(num));
+
+            if (bytes) {
+                memcpy(&num, bytes, sizeof(num));
+            }
+            constant = NUM_VAL(num);
+            break;
+        }
+        case CONST_STR: {
+            ObjStr* str = read_str(reader);
+            constant = (str) ? OBJ_VAL(str) : NIL_VAL;
+            break;
+        }
+        case CONST_FUNC: {
+            if (reader->nesting == FUNC_NESTING_MAX) {
+                reader->failed = true;
+                break;
+            }
+            reader->nesting++;
+            ObjFun* nested = read_func(reader);
+            reader->nesting--;
+            constant = (nested) ? OBJ_VAL(nested) : NIL_VAL;
+            break;
+        }
+        default:
+            reader->failed = true;
+            break;
+        }
+        if (!reader->failed) {
+            add_constant(chunk, constant);
+            write_barrier((Obj*)func);
+        }
+    }
+    if (!reader->failed && !check_code(func, reader->global_count)) {
+        reader->failed = true;
+    }
+    pop();
+
+    return (reader->failed) ? NULL : func;
+}
+
+/**
+ * Checks the names of the global slots the script refers to without
+ * reserving any, which waits for the whole file to load.
+ */
+static bool read_globals(Reader* reader)
+{
+    int count = read_count(reader);
+
+    for (int i = 0; i < count; i++) {
+        ObjStr* name = read_str(reader);
+        Value slot;
+
+        /*
+         * The script's code refers to globals by slot, so they must line up
+         * with the ones reserved by this vm, the others following them.
+         */
+        if (!name || (table_get(&vm.global_names, name, &slot)
+                ? AS_NUM(slot) != i : i < vm.globals.count)) {
+            return false;
+        }
+    }
+    reader->global_count = count;
+
+    return !reader->failed;
+}
+
+/**
+ * Reserves the global slots of a script specified by `script` once it has
+ * loaded, reading their names again from a reader specified by `reader`.
+ *
+ * Returns whether every name got the slot its code refers to.
+ */
+static bool reserve_globals(Reader* reader, ObjFun* script)
+{
+    int reserved = vm.globals.count;
+    int count = read_count(reader);
+    bool lined_up = true;
+    push(OBJ_VAL(script));
+
+    for (int i = 0; lined_up && i < count; i++) {
+        ObjStr* name = read_str(reader);
+        lined_up = name && global_slot(name) == i;
+    }
+    pop();
+
+    if (!lined_up) {
+        /* A name listed twice, the slots reserved so far are given back. */
+        for (int i = 0; i < vm.global_names.size; i++) {
+            Entry* entry = &vm.global_names.entries[i];
+
+            if (entry->key && AS_NUM(entry->value) >= reserved) {
+                table_delete(&vm.global_names, entry->key);
+            }
+        }
+        vm.globals.count = reserved;
+    }
+    return lined_up;
+}
+
+ObjFun* load_bytecode(const char* path, const char* source)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        if (!source) {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+        }
+        return NULL;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+
+    if (!fstat(fd, &info) && (size_t)info.st_size >= sizeof(Header)) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        return NULL;
+    }
+    Header header;
+    memcpy(&header, data, sizeof(header));
+
+    const uint8_t* payload = (const uint8_t*)data + sizeof(header);
+    size_t source_length = (source) ? strlen(source) : 0;
+    ObjFun* script = NULL;
+
+    if (memcmp(header.magic, "LOXC", 4) || header.version != BYTECODE_VERSION) {
+        if (!source) {
+            fprintf(stderr, "\"%s\" was not compiled by this version of clox.\n", path);
+        }
+    } else if (source && (header.source_length != source_length
+            || header.source_hash != hash_bytes(source, source_length))) {
+        /* Stale cache, the source changed since it was compiled. */
+    } else if (header.payload_size != info.st_size - sizeof(header)
+            || header.payload_hash != hash_bytes(payload, header.payload_size)) {
+        fprintf(stderr, "\"%s\" is corrupted.\n", path);
+    } else {
+        Reader reader = {payload, payload + header.payload_size, false, 0, 0};
+        Reader globals = reader;
+
+        if (!read_globals(&reader)) {
+            fprintf(stderr, "\"%s\" doesn't match the vm's globals.\n", path);
+        } else if (!(script = read_func(&reader)) || reader.at != reader.end
+                || script->upvalue_count > 0 || !reserve_globals(&globals, script)) {
+            fprintf(stderr, "\"%s\" is corrupted.\n", path);
+            script = NULL;
+        }
+    }
+    munmap(data, info.st_size);
+
+    return script;
+}
\ No newline at end of file
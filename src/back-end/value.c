@@ -59,13 +59,34 @@ void print_value(Value value)
 #endif
 }
 
+/**
+ * Compares two distinct objects specified by `a` and `b`, only found equal if
+ * they are strings with the same content, one of which isn't interned.
+ */
+static bool objs_equal(Obj* a, Obj* b)
+{
+    if (a->type != OBJ_STR || b->type != OBJ_STR) {
+        return false;
+    }
+    ObjStr* x = (ObjStr*)a;
+    ObjStr* y = (ObjStr*)b;
+
+    if ((x->is_interned && y->is_interned) || x->length != y->length) {
+        return false;
+    }
+    return memcmp(x->chars, y->chars, x->length) == 0;
+}
+
 bool values_equal(Value a, Value b)
 {
 #ifdef NAN_BOXING
     if (IS_NUM(a) && IS_NUM(b)) {
         return AS_NUM(a) == AS_NUM(b);
     }
-    return a == b;
+    if (a == b) {
+        return true;
+    }
+    return IS_OBJ(a) && IS_OBJ(b) && objs_equal(AS_OBJ(a), AS_OBJ(b));
 #else
     if (a.type != b.type) {
         return false;
@@ -78,7 +99,7 @@ bool values_equal(Value a, Value b)
     case VAL_NUM:
         return AS_NUM(a) == AS_NUM(b);
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        return AS_OBJ(a) == AS_OBJ(b) || objs_equal(AS_OBJ(a), AS_OBJ(b));
     default:
         return false;
     }
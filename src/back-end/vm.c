@@ -1,23 +1,142 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "back-end/garbage_collector.h"
 #include "back-end/vm.h"
 #include "common.h"
 #include "debug.h"
 #include "front-end/compiler.h"
 #include "memory.h"
 
+/* Heap size triggering the first full collection, unless set otherwise. */
 #define GC_THRESHOLD    0x100000
+/* Slots kept free above a frame for values the vm pushes to protect them. */
+#define STACK_RESERVE   4
+/* Number of frames shown at each end of a deep stack trace. */
+#define TRACE_FRAMES    16
+/* Number of most frequent opcode pairs reported by the profiler. */
+#define PROFILE_PAIRS   32
+
+/* Labels as values are a GNU extension, other compilers use the switch. */
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#undef THREADED_DISPATCH
+#endif
+
+/*
+ * Marks a handler running into the next one. A comment isn't enough, since
+ * the case labels come from the `CASE` macro.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define FALLTHROUGH __attribute__((fallthrough))
+#else
+#define FALLTHROUGH
+#endif
 
 Vm vm;
 
+#ifdef DEBUG_PROFILE_OPS
+/* Number of times each opcode was executed right after another one. */
+static uint64_t op_pairs[UINT8_COUNT][UINT8_COUNT];
+
+/**
+ * Opcode pair and its execution count, used to sort the profile.
+ */
+typedef struct
+{
+    uint8_t     first;
+    uint8_t     second;
+    uint64_t    count;
+} OpPair;
+
+static int compare_pairs(const void* a, const void* b)
+{
+    uint64_t x = ((const OpPair*)a)->count;
+    uint64_t y = ((const OpPair*)b)->count;
+
+    return (x < y) - (x > y);
+}
+
+static void print_profile()
+{
+    static OpPair pairs[UINT8_COUNT * UINT8_COUNT];
+    int count = 0;
+
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        for (int j = 0; j < UINT8_COUNT; j++) {
+            if (op_pairs[i][j]) {
+                pairs[count++] = (OpPair){i, j, op_pairs[i][j]};
+            }
+        }
+    }
+    qsort(pairs, count, sizeof(OpPair), compare_pairs);
+
+    fprintf(stderr, "-- opcode pairs\n");
+    for (int i = 0; i < count && i < PROFILE_PAIRS; i++) {
+        fprintf(stderr, "%12llu  %-24s %s\n",
+            (unsigned long long)pairs[i].count,
+            opcode_name(pairs[i].first), opcode_name(pairs[i].second));
+    }
+}
+#endif
+
 static Value clock_native(int argc, Value* argv)
 {
     return NUM_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static void set_stat(ObjInst* stats, const char* name, double value)
+{
+    /* The name is kept on the stack while the field may allocate a shape. */
+    push(OBJ_VAL(copy_str(name, (int)strlen(name))));
+    set_field(stats, AS_STR(vm.stack_top[-1]), NUM_VAL(value));
+    pop();
+}
+
+/**
+ * Returns an instance of a `GcStats` class whose fields hold the statistics of
+ * the garbage collector, with pauses in milliseconds and sizes in bytes, along
+ * with the number of objects of each type in the heap.
+ */
+static Value gc_stats_native(int argc, Value* argv)
+{
+    int counts[OBJ_TYPE_COUNT];
+    count_objects(counts);
+
+    /* A sweeper thread may be freeing objects meanwhile. */
+    bool locked = lock_heap();
+    GcStats gc_stats = vm.gc_stats;
+    size_t heap_size = vm.bytes_allocated;
+
+    if (locked) {
+        unlock_heap();
+    }
+    push(OBJ_VAL(copy_str("GcStats", 7)));
+    ObjClass* class = new_class(AS_STR(vm.stack_top[-1]));
+    pop();
+    push(OBJ_VAL(class));
+    ObjInst* stats = new_instance(class);
+    pop();
+    push(OBJ_VAL(stats));
+
+    set_stat(stats, "collections", gc_stats.collections);
+    set_stat(stats, "fullCollections", gc_stats.full_collections);
+    set_stat(stats, "compactions", gc_stats.compactions);
+    set_stat(stats, "totalPause", gc_stats.total_pause * 1e3);
+    set_stat(stats, "maxPause", gc_stats.max_pause * 1e3);
+    set_stat(stats, "bytesFreed", (double)gc_stats.bytes_freed);
+    set_stat(stats, "lastFreed", (double)(gc_stats.bytes_freed - gc_stats.cycle_freed));
+    set_stat(stats, "heapSize", (double)heap_size);
+    set_stat(stats, "highWater", (double)gc_stats.high_water);
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        set_stat(stats, obj_type_name((ObjType)i), counts[i]);
+    }
+    return pop();
+}
+
 static void reset_stack()
 {
     vm.stack_top = vm.stack;
@@ -34,11 +153,17 @@ static void runtime_err(const char* format, ...)
     fputs("\n", stderr);
     /* Error stack trace. */
     for (int i = vm.frame_count - 1; i >= 0; i--) {
+        /* Deep traces only show their innermost and outermost frames. */
+        if (i == vm.frame_count - TRACE_FRAMES - 1 && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES;
+            continue;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFun* func = frame->closure->function;
         size_t instruction = frame->ip - func->chunk.code - 1;
 
-        fprintf(stderr, "[line %d] in ", func->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", get_line(&func->chunk, (int)instruction));
 
         if (func->name == NULL) {
             fprintf(stderr, "script\n");
@@ -54,7 +179,23 @@ static void define_native(const char* name, NativeFun function)
     push(OBJ_VAL(copy_str(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(function)));
 
-    table_set(&vm.globals, AS_STR(vm.stack[0]), vm.stack[1]);
+    int slot = global_slot(AS_STR(vm.stack[0]));
+    vm.globals.values[slot] = vm.stack[1];
+    pop();
+    pop();
+}
+
+static ObjStr* global_name(int slot)
+{
+    /* Only needed to report errors, so the names aren't indexed by slot. */
+    for (int i = 0; i < vm.global_names.size; i++) {
+        Entry* entry = &vm.global_names.entries[i];
+
+        if (entry->key && AS_NUM(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+    return NULL;
 }
 
 static Value peek(int offset)
@@ -62,6 +203,58 @@ static Value peek(int offset)
     return vm.stack_top[-1 - offset];
 }
 
+static bool grow_frames()
+{
+    if (vm.frame_capacity == vm.frames_max) {
+        return false;
+    }
+    int capacity = GROW_CAPACITY(vm.frame_capacity);
+
+    if (capacity > vm.frames_max) {
+        capacity = vm.frames_max;
+    }
+    CallFrame* frames =
+        (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+
+    if (!frames) {
+        return false;
+    }
+    vm.frames = frames;
+    vm.frame_capacity = capacity;
+
+    return true;
+}
+
+static bool grow_stack(int needed)
+{
+    int capacity = vm.stack_capacity;
+
+    while (capacity < needed) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+
+    if (!stack) {
+        return false;
+    }
+    /* Every pointer into the old stack is moved to the same slot of the new. */
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stack_top - vm.stack));
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stack_top = stack + (vm.stack_top - vm.stack);
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stack_capacity = capacity;
+
+    return true;
+}
+
 static bool init_frame(ObjClosure* closure, int args)
 {
     if (args != closure->function->arity) {
@@ -69,7 +262,15 @@ static bool init_frame(ObjClosure* closure, int args)
             closure->function->arity, args);
         return false;
     }
-    if (vm.frame_count == FRAMES_MAX) {
+    /*
+     * The compiler knows how many slots a function uses at most, so the stack
+     * is only checked here and never on each push.
+     */
+    int needed = (int)(vm.stack_top - vm.stack) - args - 1 +
+        closure->function->max_stack + STACK_RESERVE;
+
+    if ((vm.frame_count == vm.frame_capacity && !grow_frames()) ||
+        (needed > vm.stack_capacity && !grow_stack(needed))) {
         runtime_err("Stack overflow.");
         return false;
     }
@@ -139,31 +340,153 @@ static bool call_value(Value callee, int args)
     return false;
 }
 
-static bool invoke_from_class(ObjClass* class, ObjStr* name, int args)
+/** Kinds of property found by `find_property`. */
+typedef enum
+{
+    PROPERTY_NONE,
+    PROPERTY_FIELD,
+    PROPERTY_METHOD
+} PropertyKind;
+
+static void cache_property(InlineCache* cache, Obj* shape, Obj* class,
+    Obj* target, int index)
+{
+    CacheEntry* entry = NULL;
+    /* A method cached before its class changed is replaced in place. */
+    for (int i = 0; i < cache->count && class; i++) {
+        if (cache->entries[i].shape == shape &&
+            cache->entries[i].class == class) {
+            entry = &cache->entries[i];
+        }
+    }
+    if (!entry) {
+        /* Once every entry is taken, the site keeps its first layouts. */
+        if (cache->count == CACHE_ENTRIES) {
+            return;
+        }
+        entry = &cache->entries[cache->count++];
+    }
+    entry->shape = shape;
+    entry->class = class;
+    entry->target = target;
+    entry->index = index;
+    /* Caches are only filled by instructions of the running function. */
+    write_barrier((Obj*)vm.frames[vm.frame_count - 1].closure->function);
+}
+
+static PropertyKind find_property(InlineCache* cache, ObjInst* instance,
+    ObjStr* name, Value* value)
+{
+    Obj* shape = (Obj*)instance->shape;
+    ObjClass* class = instance->class;
+    /*
+     * The shape tells where a field is and, as it lists every field, that no
+     * field shadows a method of the class.
+     */
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+
+        if (entry->shape != shape) {
+            continue;
+        }
+        if (!entry->class) {
+            *value = instance->fields[entry->index];
+            return PROPERTY_FIELD;
+        }
+        if (entry->class == (Obj*)class && entry->index == class->version) {
+            *value = OBJ_VAL(entry->target);
+            return PROPERTY_METHOD;
+        }
+    }
+    int index = shape_find(instance->shape, name);
+
+    if (index != -1) {
+        *value = instance->fields[index];
+        cache_property(cache, shape, NULL, NULL, index);
+        return PROPERTY_FIELD;
+    }
+    if (table_get(&class->methods, name, value)) {
+        cache_property(cache, shape, (Obj*)class, AS_OBJ(*value),
+            class->version);
+        return PROPERTY_METHOD;
+    }
+    return PROPERTY_NONE;
+}
+
+static bool invoke_from_class(InlineCache* cache, ObjClass* class,
+    ObjStr* name, int args)
 {
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+
+        if (entry->class == (Obj*)class && entry->index == class->version) {
+            return init_frame((ObjClosure*)entry->target, args);
+        }
+    }
     Value method;
     if (!table_get(&class->methods, name, &method)) {
         runtime_err("Undefined property '%s'.", name->chars);
         return false;
     }
+    cache_property(cache, NULL, (Obj*)class, AS_OBJ(method), class->version);
+
     return init_frame(AS_CLOSURE(method), args);
 }
 
-static bool invoke(ObjStr* name, int args)
+static bool invoke(InlineCache* cache, ObjStr* name, int args)
 {
     Value receiver = peek(args);
     if (!IS_INSTANCE(receiver)) {
         runtime_err("Only instances have methods.");
         return false;
     }
-    ObjInst* instance = AS_INSTANCE(receiver);
-    
     Value value;
-    if (table_get(&instance->fields, name, &value)) {
+
+    switch (find_property(cache, AS_INSTANCE(receiver), name, &value)) {
+    case PROPERTY_FIELD:
         vm.stack_top[-args - 1] = value;
         return call_value(value, args);
+    case PROPERTY_METHOD:
+        return init_frame(AS_CLOSURE(value), args);
+    case PROPERTY_NONE:
+        break;
+    }
+    runtime_err("Undefined property '%s'.", name->chars);
+
+    return false;
+}
+
+static void set_property(InlineCache* cache, ObjInst* instance, ObjStr* name,
+    Value value)
+{
+    Obj* shape = (Obj*)instance->shape;
+
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+
+        if (entry->shape != shape) {
+            continue;
+        }
+        if (!entry->target) {
+            instance->fields[entry->index] = value;
+            write_barrier_value((Obj*)instance, value);
+            return;
+        }
+        if (entry->index >= instance->capacity) {
+            /* The field array must grow first. */
+            set_field(instance, name, value);
+            return;
+        }
+        instance->fields[entry->index] = value;
+        instance->shape = (ObjShape*)entry->target;
+        write_barrier((Obj*)instance);
+        return;
     }
-    return invoke_from_class(instance->class, name, args);
+    int index = set_field(instance, name, value);
+    Obj* target = instance->shape != (ObjShape*)shape
+        ? (Obj*)instance->shape : NULL;
+
+    cache_property(cache, shape, NULL, target, index);
 }
 
 static bool bind_method(ObjClass* class, ObjStr* name)
@@ -209,6 +532,7 @@ static void close_upvalues(Value* last)
         ObjUpvalue* upvalue = vm.open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        write_barrier_value((Obj*)upvalue, upvalue->closed);
 
         vm.open_upvalues = upvalue->next;
     }
@@ -220,6 +544,8 @@ static void define_method(ObjStr* name)
     ObjClass* class = AS_CLASS(peek(1));
 
     table_set(&class->methods, name, method);
+    write_barrier((Obj*)class);
+    class->version++;
     pop();
 }
 
@@ -235,17 +561,7 @@ static void concat()
      * garbage collection. To keep the objects reachable, they are peeked
      * instead of popped from the stack.
      */
-    ObjStr* b = AS_STR(peek(0));
-    ObjStr* a = AS_STR(peek(1));
-
-    int len = a->length + b->length;
-    char* chars = ALLOCATE(char, len + 1);
-
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[len] = '\0';
-
-    ObjStr* result = take_str(chars, len);
+    ObjStr* result = join_str(AS_STR(peek(1)), AS_STR(peek(0)));
     pop();
     pop();
     push(OBJ_VAL(result));
@@ -253,33 +569,183 @@ static void concat()
 
 static InterpretResult run()
 {
+    /*
+     * The instruction pointer, the frame's slot base and the stack top are
+     * kept in locals so the compiler can hold them in registers. They are
+     * only written back to the frame and to the vm before anything outside of
+     * this function may look at them: calls, returns, allocations (which can
+     * trigger a collection) and errors.
+     */
     CallFrame* frame = &vm.frames[vm.frame_count - 1];
-/* Reads the byte currently pointed at and advances the frame's ip. */
-#define READ_BYTE() (*frame->ip++)
+    uint8_t* ip = frame->ip;
+    Value* slots = frame->slots;
+    Value* stack_top = vm.stack_top;
+/* Reads the byte currently pointed at and advances the ip. */
+#define READ_BYTE() (*ip++)
 /* Reads the next two bytes from the chunk. */
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+/* Reads the next three bytes from the chunk. */
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 /* Reads a byte and treats it as an index to the chunk's constant table. */
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
+/* Wide form of `READ_CONSTANT`, with a three byte index. */
+#define READ_CONSTANT_LONG() \
+    (frame->closure->function->chunk.constants.values[READ_LONG()])
 /* Wrapper around `READ_CONSTANT`, treats the value obtained as a string. */
 #define READ_STR() AS_STR(READ_CONSTANT())
+/* Reads a name, whose index takes two bytes in the wide opcodes. */
+#define READ_NAME(long_op) AS_STR(frame->closure->function->chunk.constants \
+    .values[(instruction == (long_op)) ? READ_SHORT() : READ_BYTE()])
+/* Reads two bytes and treats them as an index to the chunk's inline caches. */
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+/* Stack operations over the cached stack top. */
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(offset) (stack_top[-1 - (offset)])
+/* Writes the cached registers back before leaving the interpreter loop. */
+#define SAVE_REGISTERS() \
+    (frame->ip = ip, vm.stack_top = stack_top)
+/* Reloads the registers after the call frame stack may have changed. */
+#define LOAD_REGISTERS()                          \
+    do {                                          \
+        frame = &vm.frames[vm.frame_count - 1];   \
+        ip = frame->ip;                           \
+        slots = frame->slots;                     \
+        stack_top = vm.stack_top;                 \
+    } while (false)
+/* Reports a runtime error from the current instruction and bails out. */
+#define RUNTIME_ERR(...)                          \
+    do {                                          \
+        SAVE_REGISTERS();                         \
+        runtime_err(__VA_ARGS__);                 \
+        return INTERPRET_RUNTIME_ERROR;           \
+    } while (false)
 /* Executes numerical infix operations, pushing the result onto the stack. */
 #define BINARY_OP(value_type, op)                    \
     do {                                             \
-        if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) {  \
-            runtime_err("Operands must be numbers"); \
-            return INTERPRET_RUNTIME_ERROR;          \
+        if (!IS_NUM(PEEK(0)) || !IS_NUM(PEEK(1))) {  \
+            RUNTIME_ERR("Operands must be numbers"); \
         }                                            \
-        double b = AS_NUM(pop());                    \
-        double a = AS_NUM(pop());                    \
-        push(value_type(a op b));                    \
+        double b = AS_NUM(POP());                    \
+        double a = AS_NUM(POP());                    \
+        PUSH(value_type(a op b));                    \
     } while (false); /* Ensures that statements are within the same scope. */
+/* Adds the two values on top of the stack, either numbers or strings. */
+#define ADD_OP()                                     \
+    do {                                             \
+        if (!IS_STR(PEEK(0)) && !IS_STR(PEEK(1))) {  \
+            BINARY_OP(NUM_VAL, +);                   \
+        } else {                                     \
+            SAVE_REGISTERS();                        \
+            concat();                                \
+            stack_top = vm.stack_top;                \
+        }                                            \
+    } while (false)
+#ifdef THREADED_DISPATCH
+    /*
+     * Every handler ends by jumping straight to the handler of the following
+     * instruction, so each opcode gets its own indirect branch instead of all
+     * of them sharing the one at the top of the switch.
+     */
+    static void* dispatch_table[] = {
+        [OP_NIL]                      = &&label_OP_NIL,
+        [OP_TRUE]                     = &&label_OP_TRUE,
+        [OP_FALSE]                    = &&label_OP_FALSE,
+        [OP_EQUAL]                    = &&label_OP_EQUAL,
+        [OP_GREATER]                  = &&label_OP_GREATER,
+        [OP_LESS]                     = &&label_OP_LESS,
+        [OP_ADD]                      = &&label_OP_ADD,
+        [OP_SUBTRACT]                 = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY]                 = &&label_OP_MULTIPLY,
+        [OP_DIVIDE]                   = &&label_OP_DIVIDE,
+        [OP_NOT]                      = &&label_OP_NOT,
+        [OP_NEGATE]                   = &&label_OP_NEGATE,
+        [OP_POP]                      = &&label_OP_POP,
+        [OP_PRINT]                    = &&label_OP_PRINT,
+        [OP_CLOSE_UPVALUE]            = &&label_OP_CLOSE_UPVALUE,
+        [OP_INHERIT]                  = &&label_OP_INHERIT,
+        [OP_RETURN]                   = &&label_OP_RETURN,
+        [OP_CONSTANT]                 = &&label_OP_CONSTANT,
+        [OP_GET_LOCAL]                = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL]                = &&label_OP_SET_LOCAL,
+        [OP_GLOBAL]                   = &&label_OP_GLOBAL,
+        [OP_SET_GLOBAL]               = &&label_OP_SET_GLOBAL,
+        [OP_GET_GLOBAL]               = &&label_OP_GET_GLOBAL,
+        [OP_GET_UPVALUE]              = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]              = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]             = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]             = &&label_OP_SET_PROPERTY,
+        [OP_GET_SUPER]                = &&label_OP_GET_SUPER,
+        [OP_CALL]                     = &&label_OP_CALL,
+        [OP_CLOSURE]                  = &&label_OP_CLOSURE,
+        [OP_CLASS]                    = &&label_OP_CLASS,
+        [OP_METHOD]                   = &&label_OP_METHOD,
+        [OP_JUMP]                     = &&label_OP_JUMP,
+        [OP_JUMP_FALSE]               = &&label_OP_JUMP_FALSE,
+        [OP_LOOP]                     = &&label_OP_LOOP,
+        [OP_INVOKE]                   = &&label_OP_INVOKE,
+        [OP_SUPER_INVOKE]             = &&label_OP_SUPER_INVOKE,
+        [OP_ADD_LOCALS]               = &&label_OP_ADD_LOCALS,
+        [OP_ADD_LOCAL_CONST]          = &&label_OP_ADD_LOCAL_CONST,
+        [OP_SUBTRACT_LOCAL_CONST]     = &&label_OP_SUBTRACT_LOCAL_CONST,
+        [OP_LESS_LOCAL_CONST_JUMP]    = &&label_OP_LESS_LOCAL_CONST_JUMP,
+        [OP_GREATER_LOCAL_CONST_JUMP] = &&label_OP_GREATER_LOCAL_CONST_JUMP,
+        [OP_GET_LOCAL_PROPERTY]       = &&label_OP_GET_LOCAL_PROPERTY,
+        [OP_SET_LOCAL_POP]            = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_PROPERTY_POP]         = &&label_OP_SET_PROPERTY_POP,
+        [OP_CONSTANT_LONG]            = &&label_OP_CONSTANT_LONG,
+        [OP_CLOSURE_LONG]             = &&label_OP_CLOSURE_LONG,
+        [OP_GET_LOCAL_LONG]           = &&label_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG]           = &&label_OP_SET_LOCAL_LONG,
+        [OP_GLOBAL_LONG]              = &&label_OP_GLOBAL_LONG,
+        [OP_GET_GLOBAL_LONG]          = &&label_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]          = &&label_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE_LONG]         = &&label_OP_GET_UPVALUE_LONG,
+        [OP_SET_UPVALUE_LONG]         = &&label_OP_SET_UPVALUE_LONG,
+        [OP_GET_SUPER_LONG]           = &&label_OP_GET_SUPER_LONG,
+        [OP_CLASS_LONG]               = &&label_OP_CLASS_LONG,
+        [OP_METHOD_LONG]              = &&label_OP_METHOD_LONG,
+        [OP_GET_PROPERTY_LONG]        = &&label_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY_LONG]        = &&label_OP_SET_PROPERTY_LONG,
+        [OP_INVOKE_LONG]              = &&label_OP_INVOKE_LONG,
+        [OP_SUPER_INVOKE_LONG]        = &&label_OP_SUPER_INVOKE_LONG,
+    };
+/* Labels a handler both as a switch case and as a dispatch table target. */
+#define CASE(op) case op: label_##op
+/*
+ * Tracing and profiling need to run before every instruction, so they only
+ * happen when control goes back through the top of the loop.
+ */
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PROFILE_OPS)
+#define NEXT() break
+#else
+#define NEXT() goto *dispatch_table[instruction = READ_BYTE()]
+#endif
+#else
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
+    uint8_t instruction = OP_RETURN;
+#ifdef DEBUG_PROFILE_OPS
+    /* The first instruction follows none, so it starts no pair. */
+    bool first = true;
+#endif
 
     while (true) {
+#ifdef DEBUG_PROFILE_OPS
+        if (!first) {
+            op_pairs[instruction][*ip]++;
+        }
+        first = false;
+#endif
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value* v = vm.stack; v < vm.stack_top; v++) {
+        for (Value* v = vm.stack; v < stack_top; v++) {
             printf("[ ");
             print_value(*v);
             printf(" ]");
@@ -288,316 +754,536 @@ static InterpretResult run()
 
         disassemble_instruction(
             &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+            (int)(ip - frame->closure->function->chunk.code));
 #endif
-        uint8_t instruction;
-
         switch (instruction = READ_BYTE()) {
-        case OP_CONSTANT:
-            push(READ_CONSTANT());
-            break;
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_LOCAL: {
+        CASE(OP_CONSTANT):
+            PUSH(READ_CONSTANT());
+            NEXT();
+        CASE(OP_CONSTANT_LONG):
+            PUSH(READ_CONSTANT_LONG());
+            NEXT();
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            NEXT();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            NEXT();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            NEXT();
+        CASE(OP_POP):
+            stack_top--;
+            NEXT();
+        CASE(OP_GET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            NEXT();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_GET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(slots[slot]);
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            slots[slot] = PEEK(0);
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
+            slots[slot] = PEEK(0);
+            NEXT();
         }
-        case OP_GLOBAL: {
-            ObjStr* name = READ_STR();
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            NEXT();
         }
-        case OP_SET_GLOBAL: {
-            ObjStr* name = READ_STR();
-            if (table_set(&vm.globals, name, peek(0))) {
-                table_delete(&vm.globals, name);
-                runtime_err("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_GLOBAL):
+        CASE(OP_GLOBAL_LONG): {
+            int slot = (instruction == OP_GLOBAL) ? READ_BYTE() : READ_SHORT();
+            vm.globals.values[slot] = POP();
+            NEXT();
+        }
+        CASE(OP_SET_GLOBAL):
+        CASE(OP_SET_GLOBAL_LONG): {
+            int slot = (instruction == OP_SET_GLOBAL)
+                ? READ_BYTE() : READ_SHORT();
+            Value* global = &vm.globals.values[slot];
+
+            if (IS_UNDEFINED(*global)) {
+                RUNTIME_ERR("Undefined variable '%s'.",
+                    global_name(slot)->chars);
             }
-            break;
+            *global = PEEK(0);
+            NEXT();
         }
-        case OP_GET_GLOBAL: {
-            ObjStr* name = READ_STR();
-            Value value;
-            if (!table_get(&vm.globals, name, &value)) {
-                runtime_err("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_GET_GLOBAL):
+        CASE(OP_GET_GLOBAL_LONG): {
+            int slot = (instruction == OP_GET_GLOBAL)
+                ? READ_BYTE() : READ_SHORT();
+            Value value = vm.globals.values[slot];
+
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERR("Undefined variable '%s'.",
+                    global_name(slot)->chars);
             }
-            push(value);
-            break;
+            PUSH(value);
+            NEXT();
         }
-        case OP_GET_UPVALUE: {
+        CASE(OP_GET_UPVALUE): {
             /* Index to the current function's upvalue array. */
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            PUSH(*frame->closure->upvalues[slot]->location);
+            NEXT();
         }
-        case OP_SET_UPVALUE: {
+        CASE(OP_SET_UPVALUE): {
             uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
             /*
              * Takes stack-top value and stores it into the slot pointed by
              * the upvalue.
              */
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            *upvalue->location = PEEK(0);
+            write_barrier_value((Obj*)upvalue, PEEK(0));
+            NEXT();
         }
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                runtime_err("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            NEXT();
+        }
+        CASE(OP_SET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            write_barrier_value((Obj*)upvalue, PEEK(0));
+            NEXT();
+        }
+        CASE(OP_GET_LOCAL_PROPERTY):
+            /* Pushes the local, then carries on with the property access. */
+            PUSH(slots[READ_BYTE()]);
+            FALLTHROUGH;
+        CASE(OP_GET_PROPERTY):
+        CASE(OP_GET_PROPERTY_LONG): {
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERR("Only instances have properties.");
             }
-            ObjInst* instance = AS_INSTANCE(peek(0));
-            ObjStr* name = READ_STR();
+            ObjInst* instance = AS_INSTANCE(PEEK(0));
+            ObjStr* name = READ_NAME(OP_GET_PROPERTY_LONG);
+            InlineCache* cache = READ_CACHE();
             Value value;
 
-            if (table_get(&instance->fields, name, &value)) {
-                pop();
-                push(value);
+            switch (find_property(cache, instance, name, &value)) {
+            case PROPERTY_FIELD:
+                PEEK(0) = value;
+                break;
+            case PROPERTY_METHOD: {
+                SAVE_REGISTERS();
+                ObjBoundMethod* bound =
+                    new_bound_method(PEEK(0), AS_CLOSURE(value));
+                PEEK(0) = OBJ_VAL(bound);
                 break;
             }
-            if (!bind_method(instance->class, name)) {
-                return INTERPRET_RUNTIME_ERROR;
+            case PROPERTY_NONE:
+                RUNTIME_ERR("Undefined property '%s'.", name->chars);
             }
-            break;
+            NEXT();
         }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtime_err("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_SET_PROPERTY):
+        CASE(OP_SET_PROPERTY_LONG): {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERR("Only instances have fields.");
             }
             /*
              * The stack-top contains the value to be stored and the instance
              * whose field is being set. The instruction's operand is read and
              * the field name string is determined.
              */
-            ObjInst* instance = AS_INSTANCE(peek(1));
-            table_set(&instance->fields, READ_STR(), peek(0));
+            ObjInst* instance = AS_INSTANCE(PEEK(1));
+            ObjStr* name = READ_NAME(OP_SET_PROPERTY_LONG);
+            InlineCache* cache = READ_CACHE();
+            SAVE_REGISTERS();
+            set_property(cache, instance, name, PEEK(0));
 
-            Value value = pop();
-            pop();
-            push(value);
-            break;
+            Value value = POP();
+            PEEK(0) = value;
+            NEXT();
         }
-        case OP_GET_SUPER: {
+        CASE(OP_SET_PROPERTY_POP): {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERR("Only instances have fields.");
+            }
+            ObjInst* instance = AS_INSTANCE(PEEK(1));
             ObjStr* name = READ_STR();
-            ObjClass* super = AS_CLASS(pop());
+            InlineCache* cache = READ_CACHE();
+            SAVE_REGISTERS();
+            set_property(cache, instance, name, PEEK(0));
+            /* Both the value and the instance are discarded. */
+            stack_top -= 2;
+            NEXT();
+        }
+        CASE(OP_GET_SUPER):
+        CASE(OP_GET_SUPER_LONG): {
+            ObjStr* name = READ_NAME(OP_GET_SUPER_LONG);
+
+            /*
+             * Compiled code always has a class there, but loaded bytecode is
+             * only checked for its operands and stack depth.
+             */
+            if (!IS_CLASS(PEEK(0))) {
+                RUNTIME_ERR("Superclass must be a class.");
+            }
+            ObjClass* super = AS_CLASS(POP());
 
+            SAVE_REGISTERS();
             if (!bind_method(super, name)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            stack_top = vm.stack_top;
+            NEXT();
         }
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = POP();
 
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
+            PUSH(BOOL_VAL(values_equal(a, b)));
+            NEXT();
         }
-        case OP_GREATER:
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            NEXT();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD: {
-            if (!IS_STR(peek(0)) && !IS_STR(peek(1))) {
-                BINARY_OP(NUM_VAL, +);
-            } else {
-                concat();
-            }
-            break;
+            NEXT();
+        CASE(OP_ADD):
+            ADD_OP();
+            NEXT();
+        CASE(OP_ADD_LOCALS): {
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            PUSH(slots[a]);
+            PUSH(slots[b]);
+            ADD_OP();
+            NEXT();
+        }
+        CASE(OP_ADD_LOCAL_CONST): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            ADD_OP();
+            NEXT();
         }
-        case OP_SUBTRACT:
+        CASE(OP_SUBTRACT_LOCAL_CONST): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
             BINARY_OP(NUM_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            NEXT();
+        }
+        CASE(OP_SUBTRACT):
+            BINARY_OP(NUM_VAL, -);
+            NEXT();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUM_VAL, *);
-            break;
-        case OP_DIVIDE:
+            NEXT();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUM_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(is_falsey(pop())));
-            break;
-        case OP_NEGATE: {
-            if (!IS_NUM(peek(0))) {
-                runtime_err("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
+            NEXT();
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(is_falsey(PEEK(0)));
+            NEXT();
+        CASE(OP_NEGATE): {
+            if (!IS_NUM(PEEK(0))) {
+                RUNTIME_ERR("Operand must be a number.");
             }
-            push(NUM_VAL(-AS_NUM(pop())));
-            break;
+            PEEK(0) = NUM_VAL(-AS_NUM(PEEK(0)));
+            NEXT();
         }
-        case OP_PRINT: {
-            print_value(pop());
+        CASE(OP_PRINT): {
+            print_value(POP());
             printf("\n");
-            break;
+            NEXT();
         }
-        case OP_JUMP: {
+        CASE(OP_JUMP): {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            ip += offset;
+            NEXT();
         }
-        case OP_JUMP_FALSE: {
+        CASE(OP_JUMP_FALSE): {
             uint16_t offset = READ_SHORT();
-            if (is_falsey(peek(0))) {
-                frame->ip += offset;
+            if (is_falsey(PEEK(0))) {
+                ip += offset;
             }
-            break;
+            NEXT();
         }
-        case OP_LOOP: {
+        CASE(OP_LESS_LOCAL_CONST_JUMP): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            BINARY_OP(BOOL_VAL, <);
+
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            if (!AS_BOOL(PEEK(0))) {
+                ip += offset;
+            }
+            NEXT();
+        }
+        CASE(OP_GREATER_LOCAL_CONST_JUMP): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            BINARY_OP(BOOL_VAL, >);
+
+            uint16_t offset = READ_SHORT();
+            if (!AS_BOOL(PEEK(0))) {
+                ip += offset;
+            }
+            NEXT();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+
+            /* Loops and calls are where objects may be moved, see `compact_heap`. */
+            if (vm.compact_pending) {
+                SAVE_REGISTERS();
+                compact_heap();
+            }
+            NEXT();
         }
-        case OP_CALL: {
+        CASE(OP_CALL): {
             int args = READ_BYTE();
-            if (!call_value(peek(args), args)) {
+            SAVE_REGISTERS();
+
+            if (vm.compact_pending) {
+                compact_heap();
+            }
+            if (!call_value(PEEK(args), args)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+            LOAD_REGISTERS();
+            NEXT();
         }
-        case OP_INVOKE: {
-            ObjStr* method = READ_STR();
+        CASE(OP_INVOKE):
+        CASE(OP_INVOKE_LONG): {
+            ObjStr* method = READ_NAME(OP_INVOKE_LONG);
             int args = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
 
-            if (!invoke(method, args)) {
+            SAVE_REGISTERS();
+            if (!invoke(cache, method, args)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+            LOAD_REGISTERS();
+            NEXT();
         }
-        case OP_SUPER_INVOKE: {
-            ObjStr* method = READ_STR();
+        CASE(OP_SUPER_INVOKE):
+        CASE(OP_SUPER_INVOKE_LONG): {
+            ObjStr* method = READ_NAME(OP_SUPER_INVOKE_LONG);
             int args = READ_BYTE();
-            ObjClass* super = AS_CLASS(pop());
+            InlineCache* cache = READ_CACHE();
 
-            if (!invoke_from_class(super, method, args)) {
+            if (!IS_CLASS(PEEK(0))) {
+                RUNTIME_ERR("Superclass must be a class.");
+            }
+            ObjClass* super = AS_CLASS(POP());
+
+            SAVE_REGISTERS();
+            if (!invoke_from_class(cache, super, method, args)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+            LOAD_REGISTERS();
+            NEXT();
         }
-        case OP_CLOSURE: {
-            ObjFun* function = AS_FUNC(READ_CONSTANT());
+        CASE(OP_CLOSURE):
+        CASE(OP_CLOSURE_LONG): {
+            ObjFun* function = AS_FUNC((instruction == OP_CLOSURE)
+                ? READ_CONSTANT() : READ_CONSTANT_LONG());
+            SAVE_REGISTERS();
             ObjClosure* closure = new_closure(function);
-            push(OBJ_VAL(closure));
-            
+            PUSH(OBJ_VAL(closure));
+            /* Capturing upvalues allocates, the closure must be reachable. */
+            vm.stack_top = stack_top;
+
             for (int i = 0; i < closure->upvalue_count; i++) {
                 uint8_t is_local = READ_BYTE();
-                uint8_t index = READ_BYTE();
+                uint16_t index = READ_SHORT();
 
                 if (is_local) {
-                    closure->upvalues[i] = capture_upvalue(
-                        frame->slots + index);
+                    closure->upvalues[i] = capture_upvalue(slots + index);
                 } else {
                     closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                /* A collection while capturing may have promoted the closure. */
+                write_barrier((Obj*)closure);
             }
-            break;
+            NEXT();
         }
-        case OP_CLOSE_UPVALUE: {
-            close_upvalues(vm.stack_top - 1);
-            pop();
-            break;
+        CASE(OP_CLOSE_UPVALUE): {
+            close_upvalues(stack_top - 1);
+            stack_top--;
+            NEXT();
         }
-        case OP_CLASS: {
-            push(OBJ_VAL(new_class(READ_STR())));
-            break;
+        CASE(OP_CLASS):
+        CASE(OP_CLASS_LONG): {
+            ObjStr* name = READ_NAME(OP_CLASS_LONG);
+            SAVE_REGISTERS();
+            PUSH(OBJ_VAL(new_class(name)));
+            NEXT();
         }
-        case OP_INHERIT: {
-            Value super = peek(1);
+        CASE(OP_INHERIT): {
+            Value super = PEEK(1);
             if (!IS_CLASS(super)) {
-                runtime_err("Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERR("Superclass must be a class.");
+            }
+            if (!IS_CLASS(PEEK(0))) {
+                RUNTIME_ERR("Only classes can inherit.");
             }
-            ObjClass* sub = AS_CLASS(peek(0));
+            ObjClass* sub = AS_CLASS(PEEK(0));
+            SAVE_REGISTERS();
             table_add_all(&AS_CLASS(super)->methods, &sub->methods);
-            /* Pop subclass. */ 
-            pop();
-            break;
+            write_barrier((Obj*)sub);
+            sub->version++;
+            /* Pop subclass. */
+            stack_top--;
+            NEXT();
         }
-        case OP_RETURN: {
-            Value result = pop();
+        CASE(OP_RETURN): {
+            Value result = POP();
 
-            close_upvalues(frame->slots);
+            close_upvalues(slots);
             vm.frame_count--;
 
             if (vm.frame_count == 0) {
-                pop();
+                vm.stack_top = stack_top - 1;
                 return INTERPRET_OK;
             }
-            vm.stack_top = frame->slots;
-            push(result);
+            stack_top = slots;
+            PUSH(result);
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            ip = frame->ip;
+            slots = frame->slots;
+            NEXT();
+        }
+        CASE(OP_METHOD):
+        CASE(OP_METHOD_LONG): {
+            ObjStr* name = READ_NAME(OP_METHOD_LONG);
+
+            /* Loaded bytecode may define anything as a method of anything. */
+            if (!IS_CLASS(PEEK(1)) || !IS_CLOSURE(PEEK(0))) {
+                RUNTIME_ERR("Only functions can be methods of a class.");
+            }
+            SAVE_REGISTERS();
+            define_method(name);
+            stack_top = vm.stack_top;
+            NEXT();
         }
-        case OP_METHOD:
-            define_method(READ_STR());
-            break;
         }
     }
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
-#undef RED_STR
+#undef READ_CONSTANT_LONG
+#undef READ_STR
+#undef READ_NAME
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_REGISTERS
+#undef LOAD_REGISTERS
+#undef RUNTIME_ERR
 #undef BINARY_OP
+#undef ADD_OP
+#undef CASE
+#undef NEXT
 }
 
 void init_vm()
 {
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frame_capacity = FRAMES_INITIAL;
+    vm.frames_max = FRAMES_MAX;
+    vm.stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stack_capacity = STACK_INITIAL;
+
+    if (!vm.frames || !vm.stack) {
+        out_of_memory();
+    }
     reset_stack();
 
-    vm.objects = NULL;
+    init_heap(&vm.heap);
+    vm.sweep_page = NULL;
+    vm.sweep_word = 0;
+    vm.background_sweep = false;
+    vm.sweeping = false;
+    vm.compact = false;
+    vm.compact_pending = false;
+    vm.young_objects = NULL;
+    vm.young_capacity = 0;
+    vm.young_count = 0;
+    vm.remembered = NULL;
+    vm.remembered_capacity = 0;
+    vm.remembered_count = 0;
     vm.bytes_allocated = 0;
     vm.next_gc = GC_THRESHOLD;
+    vm.next_minor_gc = GC_NURSERY_SIZE;
+    vm.nursery_size = GC_NURSERY_SIZE;
+    vm.grow_factor = GC_HEAP_GROW_FACTOR;
+    vm.max_heap = 0;
+    vm.minor_gc = false;
+    vm.marking = false;
+    vm.slice_budget = 0;
+    vm.slice_gray_count = 0;
+    memset(&vm.gc_stats, 0, sizeof(GcStats));
+    vm.mark_threads = 1;
     vm.gray_count = 0;
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
-    init_table(&vm.globals);
+    init_table(&vm.global_names);
+    init_value_array(&vm.globals);
     init_table(&vm.strings);
     vm.init_string = NULL;
+    vm.root_shape = NULL;
     vm.init_string = copy_str("init", 4);
+    vm.root_shape = new_shape();
 
     define_native("clock", clock_native);
+    define_native("gcStats", gc_stats_native);
 }
 
 void free_vm()
 {
-    free_table(&vm.globals);
+    free_table(&vm.global_names);
+    free_value_array(&vm.globals);
     free_table(&vm.strings);
     vm.init_string = NULL;
+    vm.root_shape = NULL;
     free_objs();
+    free(vm.frames);
+    free(vm.stack);
+#ifdef DEBUG_PROFILE_OPS
+    print_profile();
+#endif
 }
 
-void push(Value value)
+int global_slot(ObjStr* name)
 {
-    *vm.stack_top = value;
-    vm.stack_top++;
-}
+    Value slot;
 
-Value pop()
-{
-    vm.stack_top--;
-    return *vm.stack_top;
+    if (table_get(&vm.global_names, name, &slot)) {
+        return (int)AS_NUM(slot);
+    }
+    /* The name must stay reachable while the slot is reserved. */
+    push(OBJ_VAL(name));
+    write_value_array(&vm.globals, UNDEFINED_VAL);
+    table_set(&vm.global_names, name, NUM_VAL(vm.globals.count - 1));
+    pop();
+
+    return vm.globals.count - 1;
 }
 
 InterpretResult interpret(const char* source)
@@ -607,13 +1293,20 @@ InterpretResult interpret(const char* source)
     if (!func) {
         return INTERPRET_COMPILE_ERROR;
     }
+    return interpret_func(func);
+}
+
+InterpretResult interpret_func(ObjFun* func)
+{
     push(OBJ_VAL(func));
 
     ObjClosure* closure = new_closure(func);
 
     pop();
     push(OBJ_VAL(closure));
-    init_frame(closure, 0);
 
+    if (!init_frame(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
     return run();
 }
\ No newline at end of file
@@ -4,6 +4,71 @@
 #include "back-end/value.h"
 #include "debug.h"
 
+/* Opcode names, indexed by their value. */
+static const char* names[] = {
+    [OP_NIL]                       = "OP_NIL",
+    [OP_TRUE]                      = "OP_TRUE",
+    [OP_FALSE]                     = "OP_FALSE",
+    [OP_EQUAL]                     = "OP_EQUAL",
+    [OP_GREATER]                   = "OP_GREATER",
+    [OP_LESS]                      = "OP_LESS",
+    [OP_ADD]                       = "OP_ADD",
+    [OP_SUBTRACT]                  = "OP_SUBTRACT",
+    [OP_MULTIPLY]                  = "OP_MULTIPLY",
+    [OP_DIVIDE]                    = "OP_DIVIDE",
+    [OP_NOT]                       = "OP_NOT",
+    [OP_NEGATE]                    = "OP_NEGATE",
+    [OP_POP]                       = "OP_POP",
+    [OP_PRINT]                     = "OP_PRINT",
+    [OP_CLOSE_UPVALUE]             = "OP_CLOSE_UPVALUE",
+    [OP_INHERIT]                   = "OP_INHERIT",
+    [OP_RETURN]                    = "OP_RETURN",
+    [OP_CONSTANT]                  = "OP_CONSTANT",
+    [OP_GET_LOCAL]                 = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]                 = "OP_SET_LOCAL",
+    [OP_GLOBAL]                    = "OP_GLOBAL",
+    [OP_SET_GLOBAL]                = "OP_SET_GLOBAL",
+    [OP_GET_GLOBAL]                = "OP_GET_GLOBAL",
+    [OP_GET_UPVALUE]               = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]               = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY]              = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]              = "OP_SET_PROPERTY",
+    [OP_GET_SUPER]                 = "OP_GET_SUPER",
+    [OP_CALL]                      = "OP_CALL",
+    [OP_CLOSURE]                   = "OP_CLOSURE",
+    [OP_CLASS]                     = "OP_CLASS",
+    [OP_METHOD]                    = "OP_METHOD",
+    [OP_JUMP]                      = "OP_JUMP",
+    [OP_JUMP_FALSE]                = "OP_JUMP_FALSE",
+    [OP_LOOP]                      = "OP_LOOP",
+    [OP_INVOKE]                    = "OP_INVOKE",
+    [OP_SUPER_INVOKE]              = "OP_SUPER_INVOKE",
+    [OP_CONSTANT_LONG]             = "OP_CONSTANT_LONG",
+    [OP_CLOSURE_LONG]              = "OP_CLOSURE_LONG",
+    [OP_GET_LOCAL_LONG]            = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG]            = "OP_SET_LOCAL_LONG",
+    [OP_GLOBAL_LONG]               = "OP_GLOBAL_LONG",
+    [OP_GET_GLOBAL_LONG]           = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG]           = "OP_SET_GLOBAL_LONG",
+    [OP_GET_UPVALUE_LONG]          = "OP_GET_UPVALUE_LONG",
+    [OP_SET_UPVALUE_LONG]          = "OP_SET_UPVALUE_LONG",
+    [OP_GET_SUPER_LONG]            = "OP_GET_SUPER_LONG",
+    [OP_CLASS_LONG]                = "OP_CLASS_LONG",
+    [OP_METHOD_LONG]               = "OP_METHOD_LONG",
+    [OP_GET_PROPERTY_LONG]         = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY_LONG]         = "OP_SET_PROPERTY_LONG",
+    [OP_INVOKE_LONG]               = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE_LONG]         = "OP_SUPER_INVOKE_LONG",
+    [OP_ADD_LOCALS]                = "OP_ADD_LOCALS",
+    [OP_ADD_LOCAL_CONST]           = "OP_ADD_LOCAL_CONST",
+    [OP_SUBTRACT_LOCAL_CONST]      = "OP_SUBTRACT_LOCAL_CONST",
+    [OP_LESS_LOCAL_CONST_JUMP]     = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_GREATER_LOCAL_CONST_JUMP]  = "OP_GREATER_LOCAL_CONST_JUMP",
+    [OP_GET_LOCAL_PROPERTY]        = "OP_GET_LOCAL_PROPERTY",
+    [OP_SET_LOCAL_POP]             = "OP_SET_LOCAL_POP",
+    [OP_SET_PROPERTY_POP]          = "OP_SET_PROPERTY_POP",
+};
+
 static int byte_instruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t slot = chunk->code[offset + 1];
@@ -12,6 +77,31 @@ static int byte_instruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int short_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
+static int long_constant(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+        chunk->code[offset + 2];
+}
+
+static int constant_long_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = long_constant(chunk, offset + 1);
+
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int constant_instruction(const char* name, Chunk* chunk, int offset)
 {
     /* Takes two bytes, one for the opcode and one for the operand. */
@@ -23,17 +113,96 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
-static int invoke_instruction(const char* name, Chunk* chunk, int offset)
+static int name_long_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/* Name operands take a byte, or two in the wide forms specified by `wide`. */
+static int property_instruction(const char* name, bool wide, Chunk* chunk, int offset)
+{
+    int constant = chunk->code[offset + 1];
+
+    if (wide) {
+        constant = (constant << 8) | chunk->code[++offset + 1];
+    }
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 4;
+}
+
+static int local_property_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+static int invoke_instruction(const char* name, bool wide, Chunk* chunk, int offset)
 {
-    uint8_t cons = chunk->code[offset + 1];
+    int cons = chunk->code[offset + 1];
+
+    if (wide) {
+        cons = (cons << 8) | chunk->code[++offset + 1];
+    }
     uint8_t args = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
 
     printf("%-16s (%d args) %4d '", name, args, cons);
     print_value(chunk->constants.values[cons]);
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
+static int locals_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int local_constant_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
+static int compare_jump_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -62,10 +231,12 @@ int disassemble_instruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = get_line(chunk, offset);
+
+    if (offset > 0 && line == get_line(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     uint8_t instruction = chunk->code[offset];
 
@@ -87,19 +258,19 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
     case OP_GLOBAL:
-        return constant_instruction("OP_GLOBAL", chunk, offset);
+        return byte_instruction("OP_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return byte_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return byte_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byte_instruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-        return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+        return property_instruction("OP_GET_PROPERTY", false, chunk, offset);
     case OP_SET_PROPERTY:
-        return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+        return property_instruction("OP_SET_PROPERTY", false, chunk, offset);
     case OP_GET_SUPER:
         return constant_instruction("OP_GET_SUPER", chunk, offset);
     case OP_GREATER:
@@ -129,14 +300,21 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case OP_CALL:
         return byte_instruction("OP_CALL", chunk, offset);
     case OP_INVOKE:
-        return invoke_instruction("OP_INVOKE", chunk, offset);
+        return invoke_instruction("OP_INVOKE", false, chunk, offset);
     case OP_SUPER_INVOKE:
-        return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-        offset++;
-        uint8_t constant = chunk->code[offset++];
+        return invoke_instruction("OP_SUPER_INVOKE", false, chunk, offset);
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+        int constant;
 
-        printf("%-16s %4d", "OP_CLOSURE", constant);
+        if (instruction == OP_CLOSURE) {
+            constant = chunk->code[offset + 1];
+            offset += 2;
+        } else {
+            constant = long_constant(chunk, offset + 1);
+            offset += 4;
+        }
+        printf("%-16s %4d", names[instruction], constant);
         print_value(chunk->constants.values[constant]);
         printf("\n");
 
@@ -144,13 +322,34 @@ int disassemble_instruction(Chunk* chunk, int offset)
 
         for (int i = 0; i < function->upvalue_count; i++) {
             int is_local = chunk->code[offset++];
-            int index = chunk->code[offset++];
+            int index = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+            offset += 2;
 
             printf("%04d      |                     %s %d\n",
-                offset - 2, is_local ? "local" : "upvalue", index);
+                offset - 3, is_local ? "local" : "upvalue", index);
         }
         return offset;
     }
+    case OP_CONSTANT_LONG:
+        return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+        return short_instruction(names[instruction], chunk, offset);
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+        return name_long_instruction(names[instruction], chunk, offset);
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+        return property_instruction(names[instruction], true, chunk, offset);
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+        return invoke_instruction(names[instruction], true, chunk, offset);
     case OP_CLOSE_UPVALUE:
         return simple_instruction("OP_CLOSE_UPVALUE", offset);
     case OP_CLASS:
@@ -161,8 +360,32 @@ int disassemble_instruction(Chunk* chunk, int offset)
         return constant_instruction("OP_METHOD", chunk, offset);
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
+    case OP_ADD_LOCALS:
+        return locals_instruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_LOCAL_CONST:
+        return local_constant_instruction("OP_ADD_LOCAL_CONST", chunk, offset);
+    case OP_SUBTRACT_LOCAL_CONST:
+        return local_constant_instruction("OP_SUBTRACT_LOCAL_CONST", chunk, offset);
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return compare_jump_instruction("OP_LESS_LOCAL_CONST_JUMP", chunk, offset);
+    case OP_GREATER_LOCAL_CONST_JUMP:
+        return compare_jump_instruction("OP_GREATER_LOCAL_CONST_JUMP", chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+        return local_property_instruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_PROPERTY_POP:
+        return property_instruction("OP_SET_PROPERTY_POP", false, chunk, offset);
     default:
         printf("Unknown opcode %d", instruction);
         return offset + 1;
     }
+}
+
+const char* opcode_name(uint8_t op)
+{
+    if (op >= sizeof(names) / sizeof(names[0]) || !names[op]) {
+        return "OP_UNKNOWN";
+    }
+    return names[op];
 }
\ No newline at end of file
@@ -8,11 +8,15 @@
 #include "common.h"
 #include "front-end/compiler.h"
 #include "front-end/scanner.h"
+#include "memory.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+/* Longest opcode sequence that can be fused into a superinstruction. */
+#define FUSE_WINDOW 4
+
 /**
  * Structure of a local variable in the language.
  * 
@@ -35,8 +39,8 @@ typedef struct
  */
 typedef struct
 {
-    uint8_t index;
-    bool    is_local;
+    uint16_t    index;
+    bool        is_local;
 } UpValue;
 
 /**
@@ -82,19 +86,34 @@ typedef struct
  * `type` is the type of `fun`.
  * `locals` is the list of variables in scope during the current compilation.
  * `local_count` is the number of locals.
+ * `local_capacity` is the length of `locals`.
  * `upvalues` is a list of variables captured by the function if it is used as
  *            a closure.
+ * `upvalue_capacity` is the length of `upvalues`.
  * `scope_depth` is the number of blocks surrounding the code being compiled.
+ * `stack_depth` is the number of stack slots the function uses at the point
+ *               being compiled, counting its locals.
+ * `recent` is the offsets of the last instructions emitted since the latest
+ *          jump target, candidates for being fused into a superinstruction.
+ * `recent_count` is the number of offsets in `recent`.
+ * `names` is a hash table whose keys are the names already in the function's
+ *         constant table and the values are their indexes.
  */
 typedef struct _Compiler
 {
     struct _Compiler*   enclosing;
     ObjFun*             fun;
     FunType             type;
-    Local               locals[UINT8_COUNT];
+    Local*              locals;
     int                 local_count;
-    UpValue             upvalues[UINT8_COUNT];
+    int                 local_capacity;
+    UpValue*            upvalues;
+    int                 upvalue_capacity;
     int                 scope_depth;
+    int                 stack_depth;
+    int                 recent[FUSE_WINDOW];
+    int                 recent_count;
+    Table               names;
 } Compiler;
 
 /** FIXME: Improve description
@@ -128,6 +147,20 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
+/**
+ * Opcode sequence replaced by a superinstruction.
+ * 
+ * `ops` is the sequence of opcodes, in the order they are emitted.
+ * `length` is the number of opcodes in the sequence.
+ * `fused` is the superinstruction emitted in place of the sequence.
+ */
+typedef struct
+{
+    uint8_t ops[FUSE_WINDOW];
+    int     length;
+    uint8_t fused;
+} Fusion;
+
 /** Structure for all the parsing functions. */
 typedef void (*ParseFun)(bool);
 
@@ -235,6 +268,23 @@ static ParseRule rules[] = {
     [TOKEN_EOF]             = {NULL, NULL, PREC_NONE},
 };
 
+/*
+ * Sequences fused into superinstructions. They were picked from the most
+ * frequent opcode pairs reported by a `PROFILE` build running the example
+ * programs, and should be revisited by rerunning it whenever the bytecode
+ * changes. Jumps may only appear as the last opcode of a sequence.
+ */
+static const Fusion fusions[] = {
+    {{OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD}, 3, OP_ADD_LOCALS},
+    {{OP_GET_LOCAL, OP_CONSTANT, OP_ADD}, 3, OP_ADD_LOCAL_CONST},
+    {{OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT}, 3, OP_SUBTRACT_LOCAL_CONST},
+    {{OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_FALSE}, 4, OP_LESS_LOCAL_CONST_JUMP},
+    {{OP_GET_LOCAL, OP_CONSTANT, OP_GREATER, OP_JUMP_FALSE}, 4, OP_GREATER_LOCAL_CONST_JUMP},
+    {{OP_GET_LOCAL, OP_GET_PROPERTY}, 2, OP_GET_LOCAL_PROPERTY},
+    {{OP_SET_LOCAL, OP_POP}, 2, OP_SET_LOCAL_POP},
+    {{OP_SET_PROPERTY, OP_POP}, 2, OP_SET_PROPERTY_POP},
+};
+
 static Chunk* current_chunk()
 {
     return &current->fun->chunk;
@@ -312,14 +362,209 @@ static void emit_byte(uint8_t byte)
     write_chunk(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_bytes(uint8_t byte_1, uint8_t byte_2)
+static void record_op()
+{
+    if (current->recent_count == FUSE_WINDOW) {
+        memmove(current->recent, current->recent + 1,
+            sizeof(int) * (FUSE_WINDOW - 1));
+        current->recent_count--;
+    }
+    current->recent[current->recent_count++] = current_chunk()->count;
+}
+
+static void break_fusion()
+{
+    /*
+     * Called once the end of the chunk becomes a jump target, or right after
+     * a jump is emitted, so that no superinstruction spans over a place where
+     * control flow may enter or leave.
+     */
+    current->recent_count = 0;
+}
+
+static void fuse()
+{
+    Chunk* chunk = current_chunk();
+
+    for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+        const Fusion* fusion = &fusions[i];
+
+        if (current->recent_count < fusion->length) {
+            continue;
+        }
+        int* starts = &current->recent[current->recent_count - fusion->length];
+        bool matches = true;
+
+        for (int j = 0; j < fusion->length && matches; j++) {
+            matches = chunk->code[starts[j]] == fusion->ops[j];
+        }
+        if (!matches) {
+            continue;
+        }
+        /*
+         * The opcodes of the sequence are dropped and their operands are
+         * moved back, right after the superinstruction's opcode.
+         */
+        int dest = starts[0] + 1;
+
+        for (int j = 0; j < fusion->length; j++) {
+            int end = (j + 1 < fusion->length) ? starts[j + 1] : chunk->count;
+
+            for (int k = starts[j] + 1; k < end; k++) {
+                chunk->code[dest++] = chunk->code[k];
+            }
+        }
+        chunk->code[starts[0]] = fusion->fused;
+        truncate_chunk(chunk, dest);
+        current->recent_count -= fusion->length - 1;
+        return;
+    }
+}
+
+static int stack_effect(uint8_t op, int operand)
+{
+    switch (op) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+        return 1;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_GLOBAL:
+    case OP_GLOBAL_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+        return -1;
+    /* The callee, or receiver, and the arguments are replaced by the result. */
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+        return -operand;
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+        return -operand - 1;
+    /*
+     * Code after a return is compiled as if the value was still there, which
+     * overestimates the depth rather than underestimating it.
+     */
+    default:
+        return 0;
+    }
+}
+
+static void adjust_stack(int effect)
 {
-    emit_byte(byte_1);
-    emit_byte(byte_2);
+    current->stack_depth += effect;
+
+    if (current->stack_depth > current->fun->max_stack) {
+        current->fun->max_stack = current->stack_depth;
+    }
+}
+
+static void emit_op(uint8_t op)
+{
+    adjust_stack(stack_effect(op, 0));
+    record_op();
+    emit_byte(op);
+    fuse();
+}
+
+static void emit_bytes(uint8_t op, uint8_t operand)
+{
+    adjust_stack(stack_effect(op, operand));
+    record_op();
+    emit_byte(op);
+    emit_byte(operand);
+    fuse();
+}
+
+/*
+ * Emits the pop of a condition on the path taken when it is false. The code
+ * emitted before it popped the condition on the other path, so its slot is
+ * counted back first.
+ */
+static void emit_false_pop()
+{
+    adjust_stack(1);
+    emit_op(OP_POP);
+}
+
+static void emit_cache()
+{
+    int cache = add_cache(current_chunk());
+
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
+/*
+ * Emits a name operand specified by `name`, which takes two bytes in the wide
+ * form of an opcode.
+ */
+static void emit_name(int name)
+{
+    if (name > UINT8_MAX) {
+        emit_byte((name >> 8) & 0xff);
+    }
+    emit_byte(name & 0xff);
+}
+
+/* Emits `op`, or `long_op` if `name` doesn't fit in a byte. */
+static void emit_property(uint8_t op, uint8_t long_op, int name)
+{
+    op = (name <= UINT8_MAX) ? op : long_op;
+    adjust_stack(stack_effect(op, 0));
+    record_op();
+    emit_byte(op);
+    emit_name(name);
+    emit_cache();
+    fuse();
+}
+
+/* Emits `op`, or `long_op` if `name` doesn't fit in a byte. */
+static void emit_invoke(uint8_t op, uint8_t long_op, int name, uint8_t args)
+{
+    op = (name <= UINT8_MAX) ? op : long_op;
+    adjust_stack(stack_effect(op, args));
+    record_op();
+    emit_byte(op);
+    emit_name(name);
+    emit_byte(args);
+    emit_cache();
+    fuse();
 }
 
 static void emit_loop(int loop_start)
 {
+    record_op();
     emit_byte(OP_LOOP);
 
     int offset = current_chunk()->count - loop_start + 2;
@@ -328,13 +573,22 @@ static void emit_loop(int loop_start)
     }
     emit_byte((offset >> 8) & 0xff);
     emit_byte(offset & 0xff);
+    break_fusion();
 }
 
 static int emit_jump(uint8_t instruction)
 {
+    record_op();
     emit_byte(instruction);
     /* Two bytes are used for the jump offset operand. */
-    emit_bytes(0xff, 0xff);
+    emit_byte(0xff);
+    emit_byte(0xff);
+    /*
+     * A conditional jump may be fused with the comparison before it, but the
+     * offset operand is kept as the last two bytes of the instruction.
+     */
+    fuse();
+    break_fusion();
 
     return current_chunk()->count - 2;
 }
@@ -349,25 +603,57 @@ static void emit_return()
     if (current->type == TYPE_INIT) {
         emit_bytes(OP_GET_LOCAL, 0);
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
-    emit_byte(OP_RETURN);
+    emit_op(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value)
+static int make_constant(Value value)
 {
     int constant = add_constant(current_chunk(), value);
+    write_barrier((Obj*)current->fun);
 
-    if (constant > UINT8_MAX) {
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk");
         return 0;
     }
-    return (uint8_t)constant;
+    return constant;
+}
+
+/*
+ * Emits `op` with a one byte operand, or `long_op` with a two byte one if
+ * `operand` doesn't fit.
+ */
+static void emit_short_or_long(uint8_t op, uint8_t long_op, int operand)
+{
+    if (operand <= UINT8_MAX) {
+        emit_bytes(op, (uint8_t)operand);
+        return;
+    }
+    emit_op(long_op);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+/*
+ * Emits `op` with a constant index specified by `constant`, or `long_op` with a
+ * three byte index if it doesn't fit in one.
+ */
+static void emit_constant_op(uint8_t op, uint8_t long_op, int constant)
+{
+    if (constant <= UINT8_MAX) {
+        emit_bytes(op, (uint8_t)constant);
+        return;
+    }
+    emit_op(long_op);
+    emit_byte((constant >> 16) & 0xff);
+    emit_byte((constant >> 8) & 0xff);
+    emit_byte(constant & 0xff);
 }
 
 static void emit_constant(Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    emit_constant_op(OP_CONSTANT, OP_CONSTANT_LONG, make_constant(value));
 }
 
 static void patch_jump(int offset)
@@ -379,6 +665,7 @@ static void patch_jump(int offset)
     }
     current_chunk()->code[offset] = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
+    break_fusion();
 }
 
 static void init_compiler(Compiler* compiler, FunType type)
@@ -386,8 +673,16 @@ static void init_compiler(Compiler* compiler, FunType type)
     compiler->enclosing = current;
     compiler->fun = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalue_capacity = 0;
     compiler->scope_depth = 0;
+    /* Slot zero holds the function or the receiver. */
+    compiler->stack_depth = 1;
+    compiler->recent_count = 0;
+    init_table(&compiler->names);
     compiler->fun = new_func();
 
     current = compiler;
@@ -395,7 +690,11 @@ static void init_compiler(Compiler* compiler, FunType type)
     if (type != TYPE_SCRIPT) {
         current->fun->name = copy_str(parser.previous.start,
                                        parser.previous.length);
+        write_barrier((Obj*)current->fun);
     }
+    current->local_capacity = GROW_CAPACITY(0);
+    current->locals = GROW_ARRAY(Local, NULL, 0, current->local_capacity);
+
     Local* local = &current->locals[current->local_count++];
     local->depth = 0;
     local->is_captured = false;
@@ -428,6 +727,13 @@ static ObjFun* end_compiler()
     return func;
 }
 
+static void free_compiler(Compiler* compiler)
+{
+    FREE_ARRAY(Local, compiler->locals, compiler->local_capacity);
+    FREE_ARRAY(UpValue, compiler->upvalues, compiler->upvalue_capacity);
+    free_table(&compiler->names);
+}
+
 static void begin_scope()
 {
     current->scope_depth++;
@@ -447,9 +753,9 @@ static void end_scope()
          * captured by a closure, it must be transferred to the heap.
          */
         if (current->locals[current->local_count - 1].is_captured) {
-            emit_byte(OP_CLOSE_UPVALUE);
+            emit_op(OP_CLOSE_UPVALUE);
         } else {
-            emit_byte(OP_POP);
+            emit_op(OP_POP);
         }
         current->local_count--;
     }
@@ -492,13 +798,13 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_var(uint8_t var)
+static void define_var(int var)
 {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_bytes(OP_GLOBAL, var);
+    emit_short_or_long(OP_GLOBAL, OP_GLOBAL_LONG, var);
 }
 
 static uint8_t arg_list()
@@ -526,7 +832,7 @@ static void and(bool can_assign)
 {
     int end_jump = emit_jump(OP_JUMP_FALSE);
 
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     parse_precedence(PREC_AND);
     patch_jump(end_jump);
@@ -542,15 +848,40 @@ static void or(bool can_assign)
      * short-circuits the expression to evaluate the right operand.
      */
     patch_jump(else_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     parse_precedence(PREC_OR);
     patch_jump(end_jump);
 }
 
-static uint8_t identifier_const(Token* name)
+static int identifier_const(Token* name)
+{
+    ObjStr* str = copy_str(name->start, name->length);
+    Value index;
+    /* Names already in the constant table are reused instead of added again. */
+    if (table_get(&current->names, str, &index)) {
+        return (int)AS_NUM(index);
+    }
+    int constant = make_constant(OBJ_VAL(str));
+
+    if (constant > UINT16_MAX) {
+        error("Too many names in one chunk.");
+        return 0;
+    }
+    table_set(&current->names, str, NUM_VAL(constant));
+
+    return constant;
+}
+
+static int identifier_global(Token* name)
 {
-    return make_constant(OBJ_VAL(copy_str(name->start, name->length)));
+    int slot = global_slot(copy_str(name->start, name->length));
+
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
 static bool identifier_equal(Token* a, Token* b)
@@ -582,7 +913,7 @@ static int resolve_local(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local)
+static int add_upvalue(Compiler* compiler, int index, bool is_local)
 {
     int upvalue_count = compiler->fun->upvalue_count;
     /*
@@ -597,12 +928,18 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local)
             return i;
         }
     }
-    if (upvalue_count == UINT8_COUNT) {
+    if (upvalue_count == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
+    if (compiler->upvalue_capacity < upvalue_count + 1) {
+        int old_capacity = compiler->upvalue_capacity;
+        compiler->upvalue_capacity = GROW_CAPACITY(old_capacity);
+        compiler->upvalues = GROW_ARRAY(UpValue, compiler->upvalues,
+            old_capacity, compiler->upvalue_capacity);
+    }
     compiler->upvalues[upvalue_count].is_local = is_local;
-    compiler->upvalues[upvalue_count].index = index;
+    compiler->upvalues[upvalue_count].index = (uint16_t)index;
 
     return compiler->fun->upvalue_count++;
 }
@@ -618,22 +955,28 @@ static int resolve_upvalue(Compiler* compiler, Token* name)
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
 
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(compiler, local, true);
     }
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(compiler, upvalue, false);
     }
     return -1;
 }
 
 static void add_local(Token name)
 {
-    if (current->local_count == UINT8_COUNT) {
+    if (current->local_count == UINT16_COUNT) {
         error("Too many variables in scope.");
         return;
     }
+    if (current->local_capacity < current->local_count + 1) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals,
+            old_capacity, current->local_capacity);
+    }
     Local* local = &current->locals[current->local_count++];
     local->name = name;
     local->depth = -1;
@@ -660,7 +1003,7 @@ static void declare_var()
     add_local(*name);
 }
 
-static uint8_t parse_var(const char* error)
+static int parse_var(const char* error)
 {
     consume(TOKEN_IDENTIFIER, error);
 
@@ -669,24 +1012,30 @@ static uint8_t parse_var(const char* error)
     if (current->scope_depth > 0) {
         return 0;
     }
-    return identifier_const(&parser.previous);
+    return identifier_global(&parser.previous);
 }
 
 static void named_variable(Token name, bool can_assign)
 {
-    uint8_t get_op, set_op;
+    uint8_t get_op, set_op, get_long_op, set_long_op;
     int var = resolve_local(current, &name);
 
     if (var != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
+        get_long_op = OP_GET_LOCAL_LONG;
+        set_long_op = OP_SET_LOCAL_LONG;
     } else if ((var = resolve_upvalue(current, &name)) != -1) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
+        get_long_op = OP_GET_UPVALUE_LONG;
+        set_long_op = OP_SET_UPVALUE_LONG;
     } else {
-        var = identifier_const(&name);
+        var = identifier_global(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
+        get_long_op = OP_GET_GLOBAL_LONG;
+        set_long_op = OP_SET_GLOBAL_LONG;
     }
     /*
      * If an attribution operator is found, instead of emmiting code for a
@@ -695,9 +1044,9 @@ static void named_variable(Token name, bool can_assign)
      */
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(set_op, (uint8_t)var);
+        emit_short_or_long(set_op, set_long_op, var);
     } else {
-        emit_bytes(get_op, (uint8_t)var);
+        emit_short_or_long(get_op, get_long_op, var);
     }
 }
 
@@ -725,18 +1074,17 @@ static void super(bool can_assign)
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
     
-    uint8_t name = identifier_const(&parser.previous);
+    int name = identifier_const(&parser.previous);
 
     named_variable(synth_token("this"), false);
 
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t args = arg_list();
         named_variable(synth_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
-        emit_byte(args);
+        emit_invoke(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name, args);
     } else {
         named_variable(synth_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_short_or_long(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -789,9 +1137,11 @@ static void function(FunType type)
             if (current->fun->arity > UINT8_MAX) {
                 error_at_current("Number of parameters exceeded.");
             }
-            uint8_t constant = parse_var("Expect parameter name.");
+            int constant = parse_var("Expect parameter name.");
 
             define_var(constant);
+            /* Arguments are already on the stack when the body runs. */
+            adjust_stack(1);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -800,19 +1150,22 @@ static void function(FunType type)
 
     ObjFun* function = end_compiler();
 
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    emit_constant_op(OP_CLOSURE, OP_CLOSURE_LONG,
+        make_constant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalue_count; i++) {
         emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte((compiler.upvalues[i].index >> 8) & 0xff);
+        emit_byte(compiler.upvalues[i].index & 0xff);
     }
+    free_compiler(&compiler);
 }
 
 static void method()
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
 
-    uint8_t constant = identifier_const(&parser.previous);
+    int constant = identifier_const(&parser.previous);
     FunType type = TYPE_METHOD;
 
     if (parser.previous.length == 4 &&
@@ -822,7 +1175,7 @@ static void method()
     }
     function(type);
 
-    emit_bytes(OP_METHOD, constant);
+    emit_short_or_long(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void class_declaration()
@@ -830,11 +1183,13 @@ static void class_declaration()
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token class_name = parser.previous;
 
-    uint8_t name = identifier_const(&parser.previous);
+    int name = identifier_const(&parser.previous);
+    int global = (current->scope_depth > 0)
+        ? 0 : identifier_global(&parser.previous);
     declare_var();
 
-    emit_bytes(OP_CLASS, name);
-    define_var(name);
+    emit_short_or_long(OP_CLASS, OP_CLASS_LONG, name);
+    define_var(global);
     
     ClassCompiler class_compiler;
     class_compiler.has_superclass = false;
@@ -854,7 +1209,7 @@ static void class_declaration()
         define_var(0);
         /* Loads the inheriting subclass onto the stack. */
         named_variable(class_name, false);
-        emit_byte(OP_INHERIT);
+        emit_op(OP_INHERIT);
         
         class_compiler.has_superclass = true;
     }
@@ -872,7 +1227,7 @@ static void class_declaration()
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     /* Values in the stack that result from the declaration must be popped. */
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     /* The scope opened for the superclass variable must be closed. */
     if (class_compiler.has_superclass) {
         end_scope();
@@ -883,7 +1238,7 @@ static void class_declaration()
 
 static void fun_declaration()
 {
-    uint8_t global = parse_var("Expect function name.");
+    int global = parse_var("Expect function name.");
     mark_initialized();
 
     function(TYPE_FUNC);
@@ -892,12 +1247,12 @@ static void fun_declaration()
 
 static void var_declaration()
 {
-    uint8_t var = parse_var("Expect a variable name.");
+    int var = parse_var("Expect a variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
     define_var(var);
@@ -907,7 +1262,7 @@ static void expr_stmt()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 }
 
 static void for_stmt()
@@ -922,6 +1277,7 @@ static void for_stmt()
     } else {
         expr_stmt();
     }
+    break_fusion();
     int loop_start = current_chunk()->count;
     int exit_jump = -1;
 
@@ -930,15 +1286,16 @@ static void for_stmt()
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         /* Jump out of the loop if the condition is false. */
         exit_jump = emit_jump(OP_JUMP_FALSE);
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
+        break_fusion();
         int inc_start = current_chunk()->count;
 
         expression();
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -951,7 +1308,7 @@ static void for_stmt()
     /* Done only if there is a condition clause. */
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        emit_false_pop();
     }
     end_scope();
 }
@@ -970,12 +1327,14 @@ static void if_stmt()
      * The result of the conditional expression must be removed from the stack
      * after the statement is evaluated.-
      */
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     statement();
-    patch_jump(jump);
 
     int else_jump = emit_jump(OP_JUMP);
 
+    patch_jump(jump);
+    emit_false_pop();
+
     if (match(TOKEN_ELSE)) {
         statement();
     }
@@ -986,7 +1345,7 @@ static void print_stmt()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+    emit_op(OP_PRINT);
 }
 
 static void return_stmt()
@@ -1007,12 +1366,13 @@ static void return_stmt()
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-        emit_byte(OP_RETURN);
+        emit_op(OP_RETURN);
     }
 }
 
 static void while_stmt()
 {
+    break_fusion();
     int loop_start = current_chunk()->count;
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
@@ -1020,7 +1380,7 @@ static void while_stmt()
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     int exit_jump = emit_jump(OP_JUMP_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     statement();
     /*
@@ -1030,7 +1390,7 @@ static void while_stmt()
     emit_loop(loop_start);
 
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    emit_false_pop();
 }
 
 static void syncronize()
@@ -1125,34 +1485,37 @@ static void binary(bool can_assign)
 
     switch (operator_type) {
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_op(OP_EQUAL);
+        emit_op(OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emit_byte(OP_EQUAL);
+        emit_op(OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emit_byte(OP_GREATER);
+        emit_op(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_op(OP_LESS);
+        emit_op(OP_NOT);
         break;
     case TOKEN_LESS:
-        emit_byte(OP_LESS);
+        emit_op(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(OP_GREATER, OP_NOT);
+        emit_op(OP_GREATER);
+        emit_op(OP_NOT);
         break;
     case TOKEN_PLUS:
-        emit_byte(OP_ADD);
+        emit_op(OP_ADD);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_SUBTRACT);
+        emit_op(OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emit_byte(OP_MULTIPLY);
+        emit_op(OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emit_byte(OP_DIVIDE);
+        emit_op(OP_DIVIDE);
         break;
     default:
         return;
@@ -1168,17 +1531,16 @@ static void call(bool can_assign)
 static void dot(bool can_assign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_const(&parser.previous);
+    int name = identifier_const(&parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_property(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t args = arg_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(args);
+        emit_invoke(OP_INVOKE, OP_INVOKE_LONG, name, args);
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_property(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
     }
 }
 
@@ -1190,10 +1552,10 @@ static void unary(bool can_assign)
 
     switch (operator_type) {
     case TOKEN_BANG:
-        emit_byte(OP_NOT);
+        emit_op(OP_NOT);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_NEGATE);
+        emit_op(OP_NEGATE);
         break;
     default:
         return;
@@ -1204,13 +1566,13 @@ static void literal(bool can_assign)
 {
     switch (parser.previous.type) {
     case TOKEN_FALSE:
-        emit_byte(OP_FALSE);
+        emit_op(OP_FALSE);
         break;
     case TOKEN_TRUE:
-        emit_byte(OP_TRUE);
+        emit_op(OP_TRUE);
         break;
     case TOKEN_NIL:
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
         break;
     default:
         return;
@@ -1233,6 +1595,7 @@ ObjFun* compile(const char* source)
         declaration();
     }
     ObjFun* fun = end_compiler();
+    free_compiler(&compiler);
 
     return (parser.had_error) ? NULL : fun;
 }
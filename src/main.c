@@ -1,11 +1,29 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "back-end/chunk.h"
+#include "back-end/garbage_collector.h"
+#include "back-end/serializer.h"
 #include "back-end/vm.h"
 #include "common.h"
 #include "debug.h"
+#include "front-end/compiler.h"
+
+/* Tells whether the collector's statistics are printed on exit. */
+static bool show_gc_stats = false;
+
+/** Prints the collector's statistics once, if asked to, before the heap goes. */
+static void report_gc_stats()
+{
+    if (show_gc_stats) {
+        show_gc_stats = false;
+        /* Output of the program comes first. */
+        fflush(stdout);
+        print_gc_stats();
+    }
+}
 
 static void repl()
 {
@@ -51,12 +69,44 @@ static char* read_file(const char* path)
     return buffer;
 }
 
+static bool has_ext(const char* path, const char* ext)
+{
+    size_t path_len = strlen(path);
+    size_t ext_len = strlen(ext);
+
+    return path_len >= ext_len && !strcmp(path + path_len - ext_len, ext);
+}
+
 static void run_file(const char* path)
 {
-    char* source = read_file(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+
+    if (has_ext(path, BYTECODE_EXT)) {
+        ObjFun* script = load_bytecode(path, NULL);
+
+        if (!script) {
+            exit(65);
+        }
+        result = interpret_func(script);
+    } else {
+        char* source = read_file(path);
+        /* A cache compiled next to the source skips the front end. */
+        size_t len = strlen(path);
+        char* cache_path = (char*)malloc(len + 2);
+
+        if (!cache_path) {
+            fprintf(stderr, "Not enough memory to run \"%s\".\n", path);
+            exit(74);
+        }
+        memcpy(cache_path, path, len);
+        cache_path[len] = 'c';
+        cache_path[len + 1] = '\0';
 
+        ObjFun* script = (has_ext(path, ".lox")) ? load_bytecode(cache_path, source) : NULL;
+        result = (script) ? interpret_func(script) : interpret(source);
+        free(cache_path);
+        free(source);
+    }
     if (result == INTERPRET_COMPILE_ERROR) {
         exit(65);
     } else if (result == INTERPRET_RUNTIME_ERROR) {
@@ -64,18 +114,183 @@ static void run_file(const char* path)
     }
 }
 
+static void compile_file(const char* out_path, const char* path)
+{
+    char* source = read_file(path);
+    ObjFun* script = compile(source);
+
+    if (!script) {
+        exit(65);
+    }
+    if (!save_bytecode(out_path, source, script)) {
+        exit(74);
+    }
+    free(source);
+}
+
+/**
+ * Parses a size in bytes specified by `text`, which may end with a `K`, `M`
+ * or `G` suffix.
+ *
+ * Returns the size, or 0 if the text isn't a valid one.
+ */
+static size_t parse_size(const char* text)
+{
+    char* end;
+    errno = 0;
+    unsigned long long size = strtoull(text, &end, 10);
+
+    if (end == text || text[0] == '-' || errno == ERANGE || size > SIZE_MAX) {
+        return 0;
+    }
+    int shifts = 0;
+
+    switch (*end) {
+    case 'G':
+        shifts++;
+        /* fall through */
+    case 'M':
+        shifts++;
+        /* fall through */
+    case 'K':
+        shifts++;
+        end++;
+        break;
+    }
+    for (int i = 0; i < shifts; i++) {
+        /* Sizes the suffix would overflow aren't valid either. */
+        if (size > SIZE_MAX >> 10) {
+            return 0;
+        }
+        size <<= 10;
+    }
+    return *end == '\0' ? (size_t)size : 0;
+}
+
+/**
+ * Sets the collector setting named `name` (`initial`, `grow`, `max` or
+ * `nursery`) to a value specified by `value`.
+ *
+ * Returns whether both the name and the value are valid.
+ */
+static bool set_gc_option(const char* name, const char* value)
+{
+    if (!strcmp(name, "grow")) {
+        char* end;
+        double factor = strtod(value, &end);
+
+        if (end == value || *end != '\0' || !(factor > 1.0)) {
+            return false;
+        }
+        vm.grow_factor = factor;
+        return true;
+    }
+    size_t size = parse_size(value);
+
+    if (size == 0) {
+        return false;
+    }
+    if (!strcmp(name, "initial")) {
+        vm.next_gc = size;
+    } else if (!strcmp(name, "max")) {
+        vm.max_heap = size;
+    } else if (!strcmp(name, "nursery")) {
+        vm.nursery_size = size;
+        vm.next_minor_gc = vm.bytes_allocated + size;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/** Reads the collector settings from the environment, which flags override. */
+static void read_gc_env()
+{
+    static const char* names[] = { "initial", "grow", "max", "nursery" };
+    static const char* vars[] = {
+        "CLOX_GC_INITIAL", "CLOX_GC_GROW", "CLOX_GC_MAX", "CLOX_GC_NURSERY"
+    };
+
+    for (int i = 0; i < 4; i++) {
+        const char* value = getenv(vars[i]);
+
+        if (value && !set_gc_option(names[i], value)) {
+            fprintf(stderr, "Invalid value \"%s\" for %s.\n", value, vars[i]);
+            exit(64);
+        }
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--max-frames count] [--gc-slice count] [--gc-threads count]\n");
+    fprintf(stderr, "            [--gc-sweeper] [--gc-compact] [--gc-initial size]\n");
+    fprintf(stderr, "            [--gc-grow factor] [--gc-max size] [--gc-nursery size]\n");
+    fprintf(stderr, "            [--gc-stats] [path]\n");
+    fprintf(stderr, "       clox --compile out%s path\n", BYTECODE_EXT);
+    exit(64);
+}
+
 int main(int argc, const char* argv[])
 {
     init_vm();
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    const char* path = NULL;
+    const char* out_path = NULL;
+
+    read_gc_env();
+    /* Programs failing with an error exit without freeing the vm. */
+    atexit(report_gc_stats);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--max-frames") && i + 1 < argc) {
+            vm.frames_max = atoi(argv[++i]);
+
+            if (vm.frames_max <= 0) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--gc-slice") && i + 1 < argc) {
+            vm.slice_budget = atoi(argv[++i]);
+
+            if (vm.slice_budget <= 0) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--gc-threads") && i + 1 < argc) {
+            vm.mark_threads = atoi(argv[++i]);
+
+            if (vm.mark_threads <= 0 || vm.mark_threads > GC_MAX_THREADS) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--gc-sweeper")) {
+            vm.background_sweep = true;
+        } else if (!strcmp(argv[i], "--gc-compact")) {
+            vm.compact = true;
+        } else if (!strcmp(argv[i], "--gc-stats")) {
+            show_gc_stats = true;
+        } else if (!strncmp(argv[i], "--gc-", 5) && i + 1 < argc) {
+            if (!set_gc_option(argv[i] + 5, argv[i + 1])) {
+                usage();
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--compile") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (out_path) {
+        if (!path) {
+            usage();
+        }
+        compile_file(out_path, path);
+    } else if (path) {
+        run_file(path);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        repl();
     }
+    report_gc_stats();
     free_vm();
 
     return 0;
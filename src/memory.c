@@ -1,9 +1,11 @@
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef DEBUG_LOG_GC
 
 #include "debug.h"
-#include <stdio.h>
 
 #endif
 
@@ -11,80 +13,320 @@
 #include "back-end/vm.h"
 #include "memory.h"
 
+#ifndef SYSTEM_MALLOC
+
+/* Pooled blocks are sized in multiples of a granule, up to a maximum size. */
+#define POOL_GRANULE        16
+#define POOL_MAX_SIZE       256
+#define POOL_CLASS_COUNT    (POOL_MAX_SIZE / POOL_GRANULE)
+/* Bytes requested from malloc whenever a size class runs out of blocks. */
+#define POOL_PAGE_SIZE      0x10000
+
+#define IS_POOLED(size)     ((size) > 0 && (size) <= POOL_MAX_SIZE)
+#define SIZE_CLASS(size)    (((size) - 1) / POOL_GRANULE)
+
+/** Free block of a size class, linked to the next one through its memory. */
+typedef struct PoolBlock
+{
+    struct PoolBlock* next;
+} PoolBlock;
+
+/**
+ * Page of memory carved into the blocks of a size class, whose header takes
+ * a whole granule so that blocks stay aligned.
+ */
+typedef union PoolPage
+{
+    union PoolPage* next;
+    char            header[POOL_GRANULE];
+} PoolPage;
+
+/* Free lists of every size class. */
+static PoolBlock* pools[POOL_CLASS_COUNT];
+/* Pages held by the pools, released only on exit. */
+static PoolPage* pool_pages = NULL;
+
+static PoolBlock* refill_pool(int size_class)
+{
+    PoolPage* page = (PoolPage*)malloc(POOL_PAGE_SIZE);
+
+    if (!page) {
+        out_of_memory();
+    }
+    page->next = pool_pages;
+    pool_pages = page;
+
+    /* Blocks are linked in address order, so they're handed out that way. */
+    size_t block_size = (size_t)(size_class + 1) * POOL_GRANULE;
+    size_t block_count = (POOL_PAGE_SIZE - sizeof(PoolPage)) / block_size;
+    char* start = (char*)(page + 1);
+    char* last = start + (block_count - 1) * block_size;
+    PoolBlock* head = (PoolBlock*)start;
+
+    for (char* block = start; block < last; block += block_size) {
+        ((PoolBlock*)block)->next = (PoolBlock*)(block + block_size);
+    }
+    ((PoolBlock*)last)->next = NULL;
+
+    return head;
+}
+
+static void* pool_alloc(size_t size)
+{
+    int size_class = SIZE_CLASS(size);
+    PoolBlock* block = pools[size_class];
+
+    if (!block) {
+        block = refill_pool(size_class);
+    }
+    pools[size_class] = block->next;
+
+    return block;
+}
+
+static void pool_free(void* ptr, size_t size)
+{
+    int size_class = SIZE_CLASS(size);
+    PoolBlock* block = (PoolBlock*)ptr;
+
+    block->next = pools[size_class];
+    pools[size_class] = block;
+}
+
+static void free_pools()
+{
+    while (pool_pages) {
+        PoolPage* next = pool_pages->next;
+        free(pool_pages);
+        pool_pages = next;
+    }
+    memset(pools, 0, sizeof(pools));
+}
+
+#endif
+
+/* Guards the heap, the pools and the count of bytes against a sweeper thread. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Tells whether the current thread holds `heap_lock`. */
+static _Thread_local bool holds_heap_lock = false;
+
+/**
+ * Counts memory going from `old_size` to `new_size` bytes, collecting garbage
+ * first if it grows past the threshold, then takes the heap lock for the
+ * memory to be handed out or taken back.
+ *
+ * Returns whether the lock was taken.
+ */
+static bool count_bytes(size_t old_size, size_t new_size)
+{
+    bool locked = lock_heap();
+    vm.bytes_allocated += (new_size - old_size);
+
+    if (vm.bytes_allocated > vm.gc_stats.high_water) {
+        vm.gc_stats.high_water = vm.bytes_allocated;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    bool collect = new_size > old_size;
+#else
+    bool collect = new_size > old_size && vm.bytes_allocated > vm.next_minor_gc;
+#endif
+    if (collect) {
+        /* Collections hold a sweeper thread still running by themselves. */
+        if (locked) {
+            unlock_heap();
+        }
+        collect_garbage();
+        locked = lock_heap();
+    }
+    if (vm.max_heap > 0 && new_size > old_size && vm.bytes_allocated > vm.max_heap) {
+        /* Memory only runs out if collecting the whole heap doesn't free enough. */
+        if (locked) {
+            unlock_heap();
+        }
+        collect_all_garbage();
+
+        if (vm.bytes_allocated > vm.max_heap) {
+            out_of_memory();
+        }
+        locked = lock_heap();
+    }
+    return locked;
+}
+
+bool lock_heap()
+{
+    if (!vm.sweeping || holds_heap_lock) {
+        return false;
+    }
+    pthread_mutex_lock(&heap_lock);
+    holds_heap_lock = true;
+
+    return true;
+}
+
+void unlock_heap()
+{
+    holds_heap_lock = false;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void out_of_memory()
+{
+    if (vm.max_heap > 0 && vm.bytes_allocated > vm.max_heap) {
+        fprintf(stderr, "Out of memory: the heap exceeds its limit of %zu bytes.\n",
+            vm.max_heap);
+    } else {
+        fprintf(stderr, "Out of memory.\n");
+    }
+    exit(70);
+}
+
+void free_object(Obj* obj, size_t size)
+{
+    bool locked = count_bytes(heap_block_size(size), 0);
+    heap_free(&vm.heap, obj);
+
+    if (locked) {
+        unlock_heap();
+    }
+}
+
+Obj* allocate_object(size_t size)
+{
+    /* Objects are counted for the memory the heap sets aside for them. */
+    bool locked = count_bytes(0, heap_block_size(size));
+    Obj* obj = heap_alloc(&vm.heap, size);
+
+    if (locked) {
+        unlock_heap();
+    }
+    return obj;
+}
+
 void free_obj(Obj* obj)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)obj, obj->type);
 #endif
+    size_t before = vm.bytes_allocated;
+
     switch (obj->type) {
     case OBJ_BOUND_METHOD: {
-        FREE(ObjBoundMethod, obj);
+        FREE_OBJ(ObjBoundMethod, obj);
         break;
     }
     case OBJ_CLASS: {
         ObjClass* class = (ObjClass*)obj;
         free_table(&class->methods);
-        FREE(ObjClass, obj);
+        FREE_OBJ(ObjClass, obj);
         break;
     }
     /* Only the closure object is freed since it doesn't own its function. */
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)obj;
         FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-        FREE(ObjClosure, obj);
+        FREE_OBJ(ObjClosure, obj);
         break;
     }
     case OBJ_FUNC: {
         ObjFun* func = (ObjFun*)obj;
         free_chunk(&func->chunk);
-        FREE(ObjFun, obj);
+        FREE_OBJ(ObjFun, obj);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInst* instance = (ObjInst*)obj;
-        free_table(&instance->fields);
-        FREE(ObjInst, obj);
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+        FREE_OBJ(ObjInst, obj);
         break;
     }
     case OBJ_NATIVE: {
-        FREE(ObjNative, obj);
+        FREE_OBJ(ObjNative, obj);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)obj;
+        free_table(&shape->slots);
+        free_table(&shape->transitions);
+        FREE_OBJ(ObjShape, obj);
         break;
     }
     case OBJ_STR: {
         ObjStr* str = (ObjStr*)obj;
-        FREE(ObjStr, obj);
+        /* Characters are stored along with the object. */
+        free_object(obj, sizeof(ObjStr) + str->length + 1);
         break;
     }
     case OBJ_UPVALUE: {
-        FREE(ObjUpvalue, obj);
+        FREE_OBJ(ObjUpvalue, obj);
         break;
     }
     }
+    vm.gc_stats.bytes_freed += before - vm.bytes_allocated;
 }
 
 void free_objs()
 {
-    Obj* obj = vm.objects;
+    wait_for_sweeper();
+    Page* page = vm.heap.pages;
+
+    while (page) {
+        Page* next = page->next;
 
-    while (obj) {
-        Obj* next = obj->next;
-        free_obj(obj);
-        obj = next;
+        if (IS_LARGE_PAGE(page)) {
+            /* Freeing a large object releases its page along with it. */
+            free_obj(LARGE_OBJECT(page));
+        } else {
+            for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+                uint64_t bits = page->allocated[i];
+
+                while (bits) {
+                    free_obj(PAGE_OBJECT(page, i, lowest_bit(bits)));
+                    bits &= bits - 1;
+                }
+            }
+        }
+        page = next;
     }
+    free_heap(&vm.heap);
+    free(vm.young_objects);
     free(vm.gray_stack);
+    free(vm.remembered);
+#ifndef SYSTEM_MALLOC
+    free_pools();
+#endif
 }
 
-void* reallocate(void* ptr, size_t old_size, size_t new_size)
+static void* resize(void* ptr, size_t old_size, size_t new_size)
 {
-    vm.bytes_allocated += (new_size - old_size);
+#ifndef SYSTEM_MALLOC
+    /* Small blocks come from the pools, moving between them as they're resized. */
+    if (IS_POOLED(old_size) || IS_POOLED(new_size)) {
+        if (IS_POOLED(old_size) && IS_POOLED(new_size)
+            && SIZE_CLASS(old_size) == SIZE_CLASS(new_size)) {
+            return ptr;
+        }
+        void* result = NULL;
 
-    if (new_size > old_size)
-#ifdef DEBUG_STRESS_GC
-        collect_garbage();
-#endif
-    if (vm.bytes_allocated > vm.next_gc) {
-        collect_garbage();
+        if (new_size > 0) {
+            result = IS_POOLED(new_size) ? pool_alloc(new_size) : malloc(new_size);
+
+            if (!result) {
+                out_of_memory();
+            }
+            if (ptr) {
+                memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+            }
+        }
+        if (IS_POOLED(old_size)) {
+            pool_free(ptr, old_size);
+        } else {
+            free(ptr);
+        }
+        return result;
     }
+#endif
     if (new_size == 0) {
         free(ptr);
         return NULL;
@@ -92,7 +334,18 @@ void* reallocate(void* ptr, size_t old_size, size_t new_size)
     void* result = realloc(ptr, new_size);
 
     if (!result) {
-        exit(1);
+        out_of_memory();
+    }
+    return result;
+}
+
+void* reallocate(void* ptr, size_t old_size, size_t new_size)
+{
+    bool locked = count_bytes(old_size, new_size);
+    void* result = resize(ptr, old_size, new_size);
+
+    if (locked) {
+        unlock_heap();
     }
     return result;
 }
\ No newline at end of file